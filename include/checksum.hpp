@@ -0,0 +1,11 @@
+#ifndef CHECKSUM_HPP
+#define CHECKSUM_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+// CRC32C (Castagnoli). Pass a previous result as crc to continue over more data.
+// Uses the SSE4.2 crc32 instruction when the CPU has it, a lookup table otherwise.
+uint32_t crc32c(const void* data, size_t len, uint32_t crc = 0);
+
+#endif
\ No newline at end of file
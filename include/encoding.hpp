@@ -0,0 +1,19 @@
+#ifndef ENCODING_HPP
+#define ENCODING_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+// Byte-substitution: dst[i] = table[src[i]]. src and dst may be the same buffer.
+// Picks an AVX-512 VBMI, AVX2 or SSSE3 kernel at runtime, a plain lookup loop otherwise.
+void subst_apply(const uint8_t table[256], const uint8_t* src, uint8_t* dst, size_t len);
+
+// subst_apply fused with CRC32C over the substituted output (the write path)
+uint32_t subst_apply_crc_out(const uint8_t table[256], const uint8_t* src, uint8_t* dst, size_t len, uint32_t crc);
+
+// CRC32C over the input fused with subst_apply (the read path: verify stored bytes, then decode)
+uint32_t subst_apply_crc_in(const uint8_t table[256], const uint8_t* src, uint8_t* dst, size_t len, uint32_t crc);
+
+const char* subst_kernel_name();
+
+#endif
\ No newline at end of file
@@ -3,7 +3,14 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 std::map<std::string,std::string> parse_json_simple(const std::string &json);
 
+// splits a raw "[...]" value (as returned by parse_json_simple) into its raw elements
+std::vector<std::string> split_json_array(const std::string &arr);
+
+std::string base64_encode(const std::string &in);
+std::string base64_decode(const std::string &in);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef LZ4_HPP
+#define LZ4_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+// LZ4 block format (no frame header). Returns the compressed size, or 0 if the
+// result would not fit in dst_cap; callers use a small dst_cap to skip data that does not shrink.
+size_t lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap);
+
+// false if src is malformed or does not decode to exactly out_len bytes
+bool lz4_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t out_len);
+
+#endif
\ No newline at end of file
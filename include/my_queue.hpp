@@ -2,14 +2,30 @@
 #define MY_QUEUE_HPP
 
 #include <string>
+#include <cstdint>
 #include <condition_variable>
 #include <mutex>
+#include <memory>
+
+enum RequestClass {
+    REQ_INTERACTIVE = 0,   // session and stats commands, never touch a path
+    REQ_BULK = 1           // everything that reads or writes the file system
+};
+
+struct BridgeReply;        // where the server leaves the answer to an HTTP bridge request
 
 struct Request {
     int client_fd;
     std::string json;
+    std::string payload;   // raw bytes of a binary upload_chunk frame
+    int req_class;
+    uint64_t enqueue_ms;   // steady-clock milliseconds, stamped by the queue
+    uint64_t deadline_ms;  // past this the worker answers with a timeout instead of running it
+    std::shared_ptr<BridgeReply> reply;   // set for bridge requests, answered there instead of on client_fd
 };
 
+uint64_t queue_now_ms();
+
 class TSQueue {
     void* impl;
 public:
@@ -17,8 +33,13 @@ public:
     ~TSQueue();
 
     void enqueue(const Request &r);
+    // like enqueue, but refuses bulk requests while the recent p99 queue wait is over budget
+    bool try_enqueue(const Request &r);
     Request dequeue();
     bool empty();
+
+    void set_wait_budget(uint64_t ms);
+    uint64_t wait_p99();
 };
 
 #endif
\ No newline at end of file
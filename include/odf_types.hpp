@@ -22,7 +22,8 @@ enum class OFSErrorCodes : int32_t {
     ERROR_NOT_IMPLEMENTED = -8,
     ERROR_INVALID_SESSION = -9,
     ERROR_DIRECTORY_NOT_EMPTY = -10,
-    ERROR_INVALID_OPERATION = -11
+    ERROR_INVALID_OPERATION = -11,
+    ERROR_SERVER_BUSY = -12
 };
 
 enum class EntryType : uint8_t {
@@ -158,13 +159,15 @@ struct FSStats {
     uint32_t total_users;
     uint32_t active_sessions;
     double fragmentation;
-    uint8_t reserved[64];
+    uint64_t logical_bytes;
+    uint64_t physical_bytes;
+    uint8_t reserved[48];
 
     FSStats() = default;
     FSStats(uint64_t total, uint64_t used, uint64_t free)
         : total_size(total), used_space(used), free_space(free),
           total_files(0), total_directories(0), total_users(0),
-          active_sessions(0), fragmentation(0.0) {
+          active_sessions(0), fragmentation(0.0), logical_bytes(0), physical_bytes(0) {
         std::memset(reserved, 0, sizeof(reserved));
     }
 };
@@ -8,7 +8,70 @@
 int fs_format(const char* omni_path, const char* config_path);
 int fs_init(const char* omni_path);
 
+// reads "key = value" from a .uconf file, fallback if the file or key is missing
+int config_get_int(const char* config_path, const char* key, int fallback);
+
+struct OFSRuntimeStats {
+    uint64_t defrag_passes;          // full scans that found nothing left to move
+    uint64_t defrag_files_moved;
+    uint64_t defrag_blocks_moved;
+    uint32_t defrag_active;          // 1 while a file is being copied
+    uint32_t free_extents;
+    uint32_t largest_free_extent;    // in blocks
+    uint64_t disk_usage;             // bytes the container occupies on the host
+    uint64_t scrub_passes;
+    uint64_t scrub_blocks_checked;
+    uint32_t bad_blocks;             // blocks whose data no longer matches their checksum
+    uint32_t bad_block_list[8];      // the first few of them
+    uint32_t bad_records;            // metadata records found corrupt on load or by the scrubber
+
+    OFSRuntimeStats() { std::memset(this, 0, sizeof(*this)); }
+};
+
 int verify_user(const char* username, const char* password);
 int get_stats(FSStats* out);
+int get_runtime_stats(OFSRuntimeStats* out);
+
+// low-priority thread that re-verifies every used block against its checksum,
+// reading at most bytes_per_sec
+void scrub_start(uint64_t bytes_per_sec);
+int get_user_role(const char* username, UserRole* role);
+
+// extends the container to new_size bytes while the server keeps running
+int fs_grow(uint64_t new_size);
+
+// low-priority thread that rewrites fragmented files into contiguous extents,
+// copying at most bytes_per_sec
+void defrag_start(uint64_t bytes_per_sec);
+
+// with compress set the file is stored as LZ4 extents, skipped when the data does not shrink
+int file_create(const char* owner, const char* path, const char* data, size_t size, bool compress = false);
+int file_read(const char* path, std::string &out);
+// reads len bytes from offset (clipped at end of file), decoding only the extents it touches
+int file_read_range(const char* path, uint64_t offset, uint64_t len, std::string &out);
+int file_edit(const char* path, const char* data, size_t size, uint32_t index);
+int file_delete(const char* path);
+int dir_create(const char* owner, const char* path);
+int set_permissions(const char* path, uint32_t permissions);
+int file_rename(const char* old_path, const char* new_path);
+
+// called after every change that took effect: kind is "create", "edit", "delete" or
+// "rename" (from is the old path, empty otherwise). Changes inside a transaction are
+// reported on commit and dropped on abort. Runs with the core lock held, so it must not block.
+typedef void (*fs_change_hook)(const char* kind, const char* path, const char* from);
+void fs_set_change_hook(fs_change_hook hook);
+
+// streaming upload: begin reserves the blocks, chunks are written straight into
+// them in order, commit publishes the metadata record
+int upload_begin(const char* owner, const char* path, uint64_t size, uint32_t &upload_id);
+int upload_chunk(uint32_t upload_id, uint64_t offset, const char* data, size_t len);
+int upload_commit(uint32_t upload_id);
+void upload_abort(uint32_t upload_id);
+
+// groups several operations into one unit; writes are flushed once on commit
+// and undone in reverse order on abort
+int fs_txn_begin();
+int fs_txn_commit();
+void fs_txn_abort();
 
 #endif
\ No newline at end of file
@@ -4,7 +4,7 @@
 #include <string>
 using namespace std;
 
-void start_server(const char* omni_path, int port);
+void start_server(const char* omni_path, int port, int queue_timeout = 30);
 void http_server_thread();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,28 @@
+#ifndef WATCH_HPP
+#define WATCH_HPP
+
+#include <cstdint>
+#include <string>
+#include <functional>
+
+// sends one pushed message; event is "changes", "stats", "resync" or "ping" (idle keepalive,
+// json empty). Returns false once the subscriber is gone.
+typedef std::function<bool(const std::string &event, const std::string &json)> WatchDeliver;
+
+// installs the core change hook and starts the stats ticker
+void watch_start();
+
+// subscribes to changes at path (and below it when recursive, else its direct children),
+// plus stats deltas when stats is set. owner groups the watches of one connection.
+uint32_t watch_add(int owner, const std::string &path, bool recursive, bool stats, WatchDeliver deliver);
+
+// pushes to the subscriber until it is removed or delivery fails; run on its own thread
+void watch_run(uint32_t id);
+
+// these return once the subscriber's sender has stopped
+bool watch_remove(int owner, uint32_t id);
+void watch_remove_owner(int owner);
+
+void watch_counts(uint32_t &subscribers, uint64_t &resyncs);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,133 @@
+// Regression stress for the background defragmenter: fragments a scratch
+// container, runs defrag with no rate limit while two threads create, edit and
+// delete files, then checks every file against what was written. The scrubber
+// runs alongside. Exits 1 on any corrupt or missing file, or on blocks the
+// scrubber reports bad.
+//   make stress && ./defrag_stress [seconds]
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include "ofs_core.hpp"
+using namespace std;
+
+static const char* OMNI = "/tmp/defrag_stress.omni";
+static const char* CONFIG = "compiled/default.uconf";
+
+static string content_for(const string &path, uint32_t version, size_t size) {
+    string s(size, '\0');
+    uint32_t x = version * 2654435761u;
+    for (size_t i = 0; i < path.size(); ++i) x = x * 31 + (unsigned char)path[i];
+    for (size_t i = 0; i < size; ++i) {
+        x = x * 1103515245u + 12345u;
+        s[i] = (char)(x >> 16);
+    }
+    return s;
+}
+
+// each thread owns its own names, so its expected map needs no locking
+static void churn(int id, atomic<bool> &stop, map<string,string> &expect, atomic<uint64_t> &ops) {
+    mt19937 rng(id + 1);
+    uint32_t version = 0;
+    while (!stop) {
+        string path = "/t" + to_string(id) + "_" + to_string(rng() % 150);
+        size_t size = 300 + rng() % 60000;
+        map<string,string>::iterator it = expect.find(path);
+        if (it == expect.end()) {
+            string data = content_for(path, ++version, size);
+            if (file_create("stress", path.c_str(), data.data(), data.size()) == 0) expect[path] = data;
+        } else if (rng() % 3 == 0) {
+            if (file_delete(path.c_str()) == 0) expect.erase(it);
+        } else {
+            string data = content_for(path, ++version, size);
+            uint32_t index = (uint32_t)(rng() % (it->second.size() + 1));
+            if (file_edit(path.c_str(), data.data(), data.size(), index) == 0) {
+                string &e = it->second;
+                if (index + data.size() > e.size()) e.resize(index + data.size());
+                e.replace(index, data.size(), data);
+            }
+        }
+        ops++;
+    }
+}
+
+static int verify(const map<string,string> &expect) {
+    int bad = 0;
+    for (map<string,string>::const_iterator it = expect.begin(); it != expect.end(); ++it) {
+        string out;
+        if (file_read(it->first.c_str(), out) != 0 || out != it->second) {
+            cout << "corrupt: " << it->first << "\n";
+            bad++;
+        }
+    }
+    return bad;
+}
+
+int main(int argc, char** argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 10;
+    if (fs_format(OMNI, CONFIG) != 0 || fs_init(OMNI) != 0) {
+        cout << "cannot create " << OMNI << "\n";
+        return 1;
+    }
+
+    // fragment: fill the container with 40-block files, drop every other one, then
+    // add 100-block files, which can now only be placed across several holes
+    map<string,string> fixed;
+    size_t slab = 40 * 4092;
+    for (int i = 0; ; ++i) {
+        string path = "/f" + to_string(i);
+        string data = content_for(path, 0, slab);
+        if (file_create("stress", path.c_str(), data.data(), data.size()) != 0) break;
+        fixed[path] = data;
+    }
+    size_t filled = fixed.size();
+    for (size_t i = 0; i < filled; i += 2) {
+        string path = "/f" + to_string(i);
+        if (file_delete(path.c_str()) == 0) fixed.erase(path);
+    }
+    for (int i = 0; i < 40; ++i) {
+        string path = "/g" + to_string(i);
+        string data = content_for(path, 0, 100 * 4092);
+        if (file_create("stress", path.c_str(), data.data(), data.size()) == 0) fixed[path] = data;
+    }
+
+    OFSRuntimeStats rt;
+    FSStats st;
+    get_stats(&st);
+    cout << "filled with " << filled << " files, fragmentation before: " << st.fragmentation << "\n";
+    if (st.fragmentation <= 0) {
+        cout << "setup left nothing fragmented\n";
+        remove(OMNI);
+        return 1;
+    }
+
+    defrag_start(0);
+    scrub_start(0);
+    atomic<bool> stop(false);
+    atomic<uint64_t> ops(0);
+    vector<map<string,string> > expect(2);
+    thread a(churn, 0, ref(stop), ref(expect[0]), ref(ops));
+    thread b(churn, 1, ref(stop), ref(expect[1]), ref(ops));
+    this_thread::sleep_for(chrono::seconds(seconds));
+    stop = true;
+    a.join();
+    b.join();
+    // let a move that is in flight finish before checking
+    this_thread::sleep_for(chrono::seconds(1));
+
+    int bad = verify(fixed) + verify(expect[0]) + verify(expect[1]);
+    get_stats(&st);
+    get_runtime_stats(&rt);
+    cout << "ops: " << ops << ", files moved: " << rt.defrag_files_moved << ", blocks moved: " << rt.defrag_blocks_moved
+         << ", fragmentation after: " << st.fragmentation << "\n";
+    cout << "scrubbed blocks: " << rt.scrub_blocks_checked << ", bad blocks: " << rt.bad_blocks << "\n";
+    cout << "corrupt files: " << bad << "\n";
+    remove(OMNI);
+    return (bad || rt.bad_blocks) ? 1 : 0;
+}
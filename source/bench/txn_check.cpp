@@ -0,0 +1,107 @@
+// Rollback checks for atomic batches: blocks freed inside a transaction and then
+// handed to another file must get their old contents back on abort, also after a
+// reload. Exits 1 on the first file that does not read back as it was.
+//   make check
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include "ofs_core.hpp"
+using namespace std;
+
+static const char* OMNI = "/tmp/txn_check.omni";
+static const char* CONFIG = "compiled/default.uconf";
+static int g_failed = 0;
+
+static void expect(const char* what, const char* path, int rc, const string &data) {
+    string out;
+    int got = file_read(path, out);
+    if (got != rc || (rc == 0 && out != data)) {
+        cout << "FAIL " << what << ": " << path << " rc=" << got << "\n";
+        g_failed++;
+    }
+}
+
+static string noise(size_t size, uint32_t seed) {
+    string s(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        s[i] = (char)(seed >> 16);
+    }
+    return s;
+}
+
+int main() {
+    if (fs_format(OMNI, CONFIG) != 0 || fs_init(OMNI) != 0) {
+        cout << "cannot create " << OMNI << "\n";
+        return 1;
+    }
+
+    // delete, then allocate the freed blocks to a new file
+    string a(10240, 'A'), b(10240, 'B');
+    file_create("check", "/a", a.data(), a.size());
+    fs_txn_begin();
+    file_delete("/a");
+    file_create("check", "/b", b.data(), b.size());
+    fs_txn_abort();
+    expect("delete then create", "/a", 0, a);
+    expect("delete then create", "/b", static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND), "");
+
+    // shrink a compressed file by making it compressible, then reuse its tail
+    string c = noise(65536, 1), zeros(65536, '\0'), d = noise(40000, 2);
+    file_create("check", "/c", c.data(), c.size(), true);
+    fs_txn_begin();
+    file_edit("/c", zeros.data(), zeros.size(), 0);
+    file_create("check", "/d", d.data(), d.size());
+    fs_txn_abort();
+    expect("shrink then create", "/c", 0, c);
+    expect("shrink then create", "/d", static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND), "");
+
+    // many edits of the same blocks roll back to the state before the first one
+    string e = noise(30000, 3);
+    file_create("check", "/e", e.data(), e.size());
+    fs_txn_begin();
+    for (int i = 0; i < 200; ++i) {
+        string x = noise(100, 100 + i);
+        file_edit("/e", x.data(), x.size(), (uint32_t)(i * 150));
+    }
+    fs_txn_abort();
+    expect("repeated edits", "/e", 0, e);
+
+    // the same edits committed
+    fs_txn_begin();
+    for (int i = 0; i < 200; ++i) {
+        string x = noise(100, 100 + i);
+        file_edit("/e", x.data(), x.size(), (uint32_t)(i * 150));
+        e.replace((size_t)i * 150, x.size(), x);
+    }
+    fs_txn_commit();
+    expect("committed edits", "/e", 0, e);
+
+    // in-place edits that grow the chain, from the middle and from exactly its end
+    string f = noise(4092 * 3, 4);
+    file_create("check", "/f", f.data(), f.size());
+    string g = noise(5000, 5), h = noise(9000, 6);
+    file_edit("/f", g.data(), g.size(), 10000);
+    f.replace(10000, g.size(), g);
+    file_edit("/f", h.data(), h.size(), (uint32_t)f.size());
+    f += h;
+    expect("growing edits", "/f", 0, f);
+
+    // what abort restored must also be what is on disk
+    fs_init(OMNI);
+    expect("after reload", "/a", 0, a);
+    expect("after reload", "/c", 0, c);
+    expect("after reload", "/e", 0, e);
+    expect("after reload", "/f", 0, f);
+
+    OFSRuntimeStats rt;
+    get_runtime_stats(&rt);
+    if (rt.bad_blocks || rt.bad_records) {
+        cout << "FAIL bad blocks " << rt.bad_blocks << ", bad records " << rt.bad_records << "\n";
+        g_failed++;
+    }
+    cout << (g_failed ? "failed: " + to_string(g_failed) : string("ok")) << "\n";
+    remove(OMNI);
+    return g_failed ? 1 : 0;
+}
@@ -0,0 +1,45 @@
+#include "../../include/checksum.hpp"
+#include <cstring>
+#include <nmmintrin.h>
+
+using namespace std;
+
+struct Crc32cTable {
+    uint32_t t[256];
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : (c >> 1);
+            t[i] = c;
+        }
+    }
+};
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char* p, size_t len) {
+    static const Crc32cTable table;
+    while (len--) crc = table.t[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (len--) c32 = _mm_crc32_u8(c32, *p++);
+    return c32;
+}
+
+uint32_t crc32c(const void* data, size_t len, uint32_t crc) {
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    const unsigned char* p = (const unsigned char*)data;
+    crc = ~crc;
+    crc = has_sse42 ? crc32c_sse42(crc, p, len) : crc32c_table(crc, p, len);
+    return ~crc;
+}
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "../../include/encoding.hpp"
+#include "../../include/checksum.hpp"
+#include <immintrin.h>
+
+using namespace std;
+
+// Fused passes work in pieces small enough to stay in L1 between the two steps.
+static const size_t FUSE_CHUNK = 1024;
+
+// SSSE3/AVX2: the 256-entry table is split into 16 rows of 16 by the high nibble.
+// Before row h the input has had 16*h subtracted; a saturating add of 0x70 then
+// maps bytes whose high nibble is h to 0x70..0x7F (pshufb uses the low nibble)
+// and every other byte to 0x80 or more, which pshufb turns into zero. OR-ing the
+// 16 row lookups gives the result. Two vectors share each row per iteration.
+
+static void subst_scalar(const uint8_t* table, const uint8_t* src, uint8_t* dst, size_t len) {
+    for (size_t i = 0; i < len; ++i) dst[i] = table[src[i]];
+}
+
+__attribute__((target("ssse3")))
+static void subst_ssse3(const uint8_t* table, const uint8_t* src, uint8_t* dst, size_t len) {
+    __m128i rows[16];
+    for (int h = 0; h < 16; ++h) rows[h] = _mm_loadu_si128((const __m128i*)(table + 16 * h));
+    const __m128i bias = _mm_set1_epi8(0x70);
+    const __m128i step = _mm_set1_epi8(0x10);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+        __m128i oa = _mm_setzero_si128(), ob = _mm_setzero_si128();
+#pragma GCC unroll 16
+        for (int h = 0; h < 16; ++h) {
+            oa = _mm_or_si128(oa, _mm_shuffle_epi8(rows[h], _mm_adds_epu8(a, bias)));
+            ob = _mm_or_si128(ob, _mm_shuffle_epi8(rows[h], _mm_adds_epu8(b, bias)));
+            a = _mm_sub_epi8(a, step);
+            b = _mm_sub_epi8(b, step);
+        }
+        _mm_storeu_si128((__m128i*)(dst + i), oa);
+        _mm_storeu_si128((__m128i*)(dst + i + 16), ob);
+    }
+    subst_scalar(table, src + i, dst + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void subst_avx2(const uint8_t* table, const uint8_t* src, uint8_t* dst, size_t len) {
+    __m256i rows[16];
+    for (int h = 0; h < 16; ++h) {
+        rows[h] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(table + 16 * h)));
+    }
+    const __m256i bias = _mm256_set1_epi8(0x70);
+    const __m256i step = _mm256_set1_epi8(0x10);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+        __m256i oa = _mm256_setzero_si256(), ob = _mm256_setzero_si256();
+#pragma GCC unroll 16
+        for (int h = 0; h < 16; ++h) {
+            oa = _mm256_or_si256(oa, _mm256_shuffle_epi8(rows[h], _mm256_adds_epu8(a, bias)));
+            ob = _mm256_or_si256(ob, _mm256_shuffle_epi8(rows[h], _mm256_adds_epu8(b, bias)));
+            a = _mm256_sub_epi8(a, step);
+            b = _mm256_sub_epi8(b, step);
+        }
+        _mm256_storeu_si256((__m256i*)(dst + i), oa);
+        _mm256_storeu_si256((__m256i*)(dst + i + 32), ob);
+    }
+    subst_scalar(table, src + i, dst + i, len - i);
+}
+
+// AVX-512 VBMI: vpermi2b looks up 128 entries at once, so the low and high halves
+// of the table take two permutes and bit 7 of the input picks between them.
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void subst_vbmi(const uint8_t* table, const uint8_t* src, uint8_t* dst, size_t len) {
+    const __m512i t0 = _mm512_loadu_si512((const void*)table);
+    const __m512i t1 = _mm512_loadu_si512((const void*)(table + 64));
+    const __m512i t2 = _mm512_loadu_si512((const void*)(table + 128));
+    const __m512i t3 = _mm512_loadu_si512((const void*)(table + 192));
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m512i x = _mm512_loadu_si512((const void*)(src + i));
+        __m512i lo = _mm512_permutex2var_epi8(t0, x, t1);
+        __m512i hi = _mm512_permutex2var_epi8(t2, x, t3);
+        _mm512_storeu_si512((void*)(dst + i), _mm512_mask_blend_epi8(_mm512_movepi8_mask(x), lo, hi));
+    }
+    subst_scalar(table, src + i, dst + i, len - i);
+}
+
+typedef void (*SubstKernel)(const uint8_t*, const uint8_t*, uint8_t*, size_t);
+
+static SubstKernel pick_kernel(const char** name) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw")) {
+        *name = "avx512vbmi";
+        return subst_vbmi;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return subst_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        *name = "ssse3";
+        return subst_ssse3;
+    }
+    *name = "scalar";
+    return subst_scalar;
+}
+
+static const char* g_kernel_name = "";
+static const SubstKernel g_kernel = pick_kernel(&g_kernel_name);
+
+void subst_apply(const uint8_t table[256], const uint8_t* src, uint8_t* dst, size_t len) {
+    g_kernel(table, src, dst, len);
+}
+
+uint32_t subst_apply_crc_out(const uint8_t table[256], const uint8_t* src, uint8_t* dst, size_t len, uint32_t crc) {
+    for (size_t off = 0; off < len; off += FUSE_CHUNK) {
+        size_t n = len - off < FUSE_CHUNK ? len - off : FUSE_CHUNK;
+        g_kernel(table, src + off, dst + off, n);
+        crc = crc32c(dst + off, n, crc);
+    }
+    return crc;
+}
+
+uint32_t subst_apply_crc_in(const uint8_t table[256], const uint8_t* src, uint8_t* dst, size_t len, uint32_t crc) {
+    for (size_t off = 0; off < len; off += FUSE_CHUNK) {
+        size_t n = len - off < FUSE_CHUNK ? len - off : FUSE_CHUNK;
+        crc = crc32c(src + off, n, crc);
+        g_kernel(table, src + off, dst + off, n);
+    }
+    return crc;
+}
+
+const char* subst_kernel_name() {
+    return g_kernel_name;
+}
\ No newline at end of file
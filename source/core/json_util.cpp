@@ -2,9 +2,32 @@
 #include <string>
 #include <map>
 #include <cctype>
+#include <cstdint>
 
 using namespace std;
 
+// returns the index just past the balanced [...] or {...} starting at i
+static size_t skip_nested(const string &json, size_t i) {
+    size_t n = json.size();
+    int depth = 0;
+    bool in_str = false;
+    for (; i < n; ++i) {
+        char c = json[i];
+        if (in_str) {
+            if (c == '\\') ++i;
+            else if (c == '\"') in_str = false;
+            continue;
+        }
+        if (c == '\"') in_str = true;
+        else if (c == '[' || c == '{') depth++;
+        else if (c == ']' || c == '}') {
+            depth--;
+            if (depth == 0) return i + 1;
+        }
+    }
+    return n;
+}
+
 map<string,string> parse_json_simple(const string &json) {
     map<string,string> out;
     size_t i = 0, n = json.size();
@@ -35,6 +58,10 @@ map<string,string> parse_json_simple(const string &json) {
                 ++i;
                 while (i < n && json[i] != '\"') { val.push_back(json[i++]); }
                 if (i < n && json[i] == '\"') ++i;
+            } else if (i < n && (json[i] == '[' || json[i] == '{')) {
+                size_t end = skip_nested(json, i);
+                val = json.substr(i, end - i);
+                i = end;
             } else {
                 while (i < n && json[i] != ',' && json[i] != '}') {
                     val.push_back(json[i++]);
@@ -57,5 +84,77 @@ map<string,string> parse_json_simple(const string &json) {
         if (i < n && json[i] == ',') ++i;
     }
 
+    return out;
+}
+
+vector<string> split_json_array(const string &arr) {
+    vector<string> out;
+    size_t i = 0, n = arr.size();
+    while (i < n && arr[i] != '[') ++i;
+    if (i == n) return out;
+    ++i;
+
+    while (i < n) {
+        while (i < n && (isspace((unsigned char)arr[i]) || arr[i] == ',')) ++i;
+        if (i >= n || arr[i] == ']') break;
+        size_t start = i;
+        if (arr[i] == '{' || arr[i] == '[') {
+            i = skip_nested(arr, i);
+        } else {
+            while (i < n && arr[i] != ',' && arr[i] != ']') ++i;
+        }
+        out.push_back(arr.substr(start, i - start));
+    }
+    return out;
+}
+
+static const char *B64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+string base64_encode(const string &in) {
+    string out;
+    out.reserve(((in.size() + 2) / 3) * 4);
+    size_t i = 0;
+    while (i + 2 < in.size()) {
+        uint32_t v = ((unsigned char)in[i] << 16) | ((unsigned char)in[i+1] << 8) | (unsigned char)in[i+2];
+        out.push_back(B64[(v >> 18) & 63]);
+        out.push_back(B64[(v >> 12) & 63]);
+        out.push_back(B64[(v >> 6) & 63]);
+        out.push_back(B64[v & 63]);
+        i += 3;
+    }
+    if (i + 1 == in.size()) {
+        uint32_t v = ((unsigned char)in[i] << 16);
+        out.push_back(B64[(v >> 18) & 63]);
+        out.push_back(B64[(v >> 12) & 63]);
+        out += "==";
+    } else if (i + 2 == in.size()) {
+        uint32_t v = ((unsigned char)in[i] << 16) | ((unsigned char)in[i+1] << 8);
+        out.push_back(B64[(v >> 18) & 63]);
+        out.push_back(B64[(v >> 12) & 63]);
+        out.push_back(B64[(v >> 6) & 63]);
+        out.push_back('=');
+    }
+    return out;
+}
+
+string base64_decode(const string &in) {
+    int rev[256];
+    for (int k = 0; k < 256; ++k) rev[k] = -1;
+    for (int k = 0; k < 64; ++k) rev[(unsigned char)B64[k]] = k;
+
+    string out;
+    out.reserve((in.size() / 4) * 3);
+    uint32_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < in.size(); ++i) {
+        int d = rev[(unsigned char)in[i]];
+        if (d < 0) continue;
+        acc = (acc << 6) | (uint32_t)d;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)((acc >> bits) & 0xFF));
+        }
+    }
     return out;
 }
\ No newline at end of file
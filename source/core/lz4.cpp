@@ -0,0 +1,150 @@
+#include "../../include/lz4.hpp"
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+static const int HASH_LOG = 12;
+static const size_t MIN_MATCH = 4;
+static const size_t LAST_LITERALS = 5;   // the block must end with this many literals
+static const size_t MF_LIMIT = 12;       // no match may start closer than this to the end
+static const size_t MAX_OFFSET = 65535;
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static void put_length(uint8_t* dst, size_t &op, size_t n) {
+    while (n >= 255) {
+        dst[op++] = 255;
+        n -= 255;
+    }
+    dst[op++] = (uint8_t)n;
+}
+
+// one sequence: literals, then a match (match_len 0 for the closing literals-only sequence)
+static bool emit(uint8_t* dst, size_t cap, size_t &op, const uint8_t* lit, size_t lit_len,
+                 size_t offset, size_t match_len) {
+    size_t worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if (op + worst > cap) return false;
+    size_t ml = match_len ? match_len - MIN_MATCH : 0;
+    uint8_t* token = dst + op++;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) put_length(dst, op, lit_len - 15);
+    if (lit_len) memcpy(dst + op, lit, lit_len);
+    op += lit_len;
+    if (!match_len) return true;
+    dst[op++] = (uint8_t)(offset & 0xFF);
+    dst[op++] = (uint8_t)(offset >> 8);
+    *token |= (uint8_t)(ml < 15 ? ml : 15);
+    if (ml >= 15) put_length(dst, op, ml - 15);
+    return true;
+}
+
+size_t lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap) {
+    uint32_t table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+    size_t ip = 0, anchor = 0, op = 0;
+
+    if (len > MF_LIMIT) {
+        size_t limit = len - MF_LIMIT;
+        size_t match_end = len - LAST_LITERALS;
+        ip = 1;
+        while (ip < limit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash4(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != seq) {
+                // step faster through data that keeps missing so incompressible input stays cheap
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            // extend 8 bytes at a time; the first differing byte is the lowest set bit (little endian)
+            size_t m = MIN_MATCH;
+            bool ended = false;
+            while (!ended && ip + m + 8 <= match_end) {
+                uint64_t diff = read64(src + ip + m) ^ read64(src + ref + m);
+                if (diff) {
+                    m += __builtin_ctzll(diff) >> 3;
+                    ended = true;
+                } else {
+                    m += 8;
+                }
+            }
+            while (!ended && ip + m < match_end && src[ip + m] == src[ref + m]) m++;
+            if (!emit(dst, dst_cap, op, src + anchor, ip - anchor, ip - ref, m)) return 0;
+            ip += m;
+            anchor = ip;
+            if (ip < limit) table[hash4(read32(src + ip - 2))] = (uint32_t)(ip - 2);
+        }
+    }
+    if (!emit(dst, dst_cap, op, src + anchor, len - anchor, 0, 0)) return 0;
+    return op;
+}
+
+static bool get_length(const uint8_t* src, size_t len, size_t &ip, size_t &n) {
+    uint8_t b;
+    do {
+        if (ip >= len) return false;
+        b = src[ip++];
+        n += b;
+    } while (b == 255);
+    return true;
+}
+
+bool lz4_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t out_len) {
+    size_t ip = 0, op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        size_t lit = token >> 4;
+        if (lit == 15 && !get_length(src, len, ip, lit)) return false;
+        if (lit > len - ip || lit > out_len - op) return false;
+        // short runs are copied with a fixed 16-byte move when both sides have room
+        if (lit <= 16 && len - ip >= 16 && out_len - op >= 16) memcpy(dst + op, src + ip, 16);
+        else memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == len) break;
+
+        if (len - ip < 2) return false;
+        size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return false;
+        size_t m = token & 15;
+        if (m == 15 && !get_length(src, len, ip, m)) return false;
+        m += MIN_MATCH;
+        if (m > out_len - op) return false;
+        const uint8_t* ref = dst + op - offset;
+        if (offset >= 8 && out_len - op >= m + 8) {
+            for (size_t k = 0; k < m; k += 8) memcpy(dst + op + k, ref + k, 8);
+        } else if (offset >= m) {
+            memcpy(dst + op, ref, m);
+        } else {
+            // overlapping run: every copy doubles the repeated pattern already written
+            for (size_t done = 0; done < m; ) {
+                size_t step = min(m - done, offset + done);
+                memcpy(dst + op + done, ref, step);
+                done += step;
+            }
+        }
+        op += m;
+    }
+    return op == out_len;
+}
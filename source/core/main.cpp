@@ -6,6 +6,7 @@ using namespace std;
 int main() {
     fs_format("compiled/sample.omni", "compiled/default.uconf");
     fs_init("compiled/sample.omni");
-    start_server("compiled/sample.omni", 8080);
+    int queue_timeout = config_get_int("compiled/default.uconf", "queue_timeout", 30);
+    start_server("compiled/sample.omni", 8080, queue_timeout);
     return 0;
 }
\ No newline at end of file
@@ -3,10 +3,177 @@
 #include <string>
 #include <ctime>
 #include <cstring>
+#include <cstdlib>
 #include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <cstddef>
 #include "../../include/ofs_core.hpp"
+#include "../../include/checksum.hpp"
+#include "../../include/encoding.hpp"
+#include "../../include/lz4.hpp"
 using namespace std;
 
+// header.reserved[0..255] holds the byte-substitution table
+static const int RSV_MAX_FILES = 256;
+static const int RSV_TOTAL_BLOCKS = 260;
+static const int RSV_MAP_CAPACITY = 264;
+static const int RSV_FEATURES = 268;
+static const int RSV_HEADER_CRC = 272;
+
+static const uint32_t FEATURE_CHECKSUMS = 1;
+static const uint32_t FEATURE_ENCODED = 2;     // block payloads go through the substitution table
+
+// each record keeps its CRC32C in the last 4 bytes of its reserved area
+static const size_t META_CRC_OFF = offsetof(FileMetadata, reserved) + sizeof(((FileMetadata*)0)->reserved) - 4;
+static const size_t USER_CRC_OFF = offsetof(UserInfo, reserved) + sizeof(((UserInfo*)0)->reserved) - 4;
+static const size_t HEADER_CRC_OFF = offsetof(OMNIHeader, reserved) + RSV_HEADER_CRC;
+
+// the free map is reserved for this many bytes of container so fs_grow can extend it in place
+static const uint64_t MAX_CONTAINER_SIZE = 4ULL << 30;
+// freed runs at least this long are punched out of the host file
+static const uint32_t PUNCH_MIN_BLOCKS = 16;
+
+// compressed files: FileMetadata::reserved[META_FLAGS] carries these bits. The stored
+// stream starts with the extent map, one {offset, length} pair per COMP_CHUNK of content
+// (offset is past the map, EXTENT_RAW marks a chunk kept as is), followed by the extents.
+// entry.size is the logical size and actual_size the stored size.
+static const size_t META_FLAGS = 0;
+static const uint8_t META_COMPRESS = 1;     // compression requested for this file
+static const uint8_t META_COMPRESSED = 2;   // content is currently stored as extents
+static const uint8_t META_INLINE = 4;       // content lives in the record itself, see below
+static const uint32_t COMP_CHUNK = 64 * 1024;
+static const uint32_t EXTENT_RAW = 0x80000000u;
+
+// small files are kept in the unused tail of FileMetadata::path when the path is
+// shorter than INLINE_OFF, so they need no blocks and no free-map update
+static const size_t INLINE_OFF = 256;
+static const size_t INLINE_MAX = sizeof(((FileMetadata*)0)->path) - INLINE_OFF;
+
+struct UploadSession {
+    string owner;
+    string path;
+    uint64_t size;
+    uint64_t received;
+    vector<uint32_t> blocks;
+    time_t last_active;
+};
+
+// uploads that see no chunk for this long give their blocks back
+static const int UPLOAD_IDLE_SECONDS = 600;
+
+struct ChangeRec {
+    string kind;
+    string path;
+    string from;
+};
+
+struct UndoRec {
+    int kind;          // 0 = metadata record, 1 = free map byte, 2 = block
+    uint32_t index;
+    string bytes;
+};
+
+static string g_omni_path;
+static fstream g_omni;
+static int g_omni_fd = -1;              // raw fd for fallocate, data goes through g_omni
+static OMNIHeader g_hdr;
+static uint32_t g_max_files = 0;
+static uint32_t g_nblocks = 0;
+static uint32_t g_map_capacity = 0;
+static uint64_t g_map_off = 0;
+static uint64_t g_crc_off = 0;
+static uint64_t g_data_off = 0;
+static bool g_checksums = false;
+static vector<uint32_t> g_crc;           // CRC32C of every block, [0] unused
+static bool g_encoded = false;
+static uint8_t g_enc[256];               // original byte -> stored byte, from header.reserved[0..255]
+static uint8_t g_dec[256];
+static vector<char> g_enc_buf;
+static set<uint32_t> g_bad_blocks;
+static set<uint32_t> g_unwritten;       // allocated but not written since, their checksum is stale
+static vector<FileMetadata> g_meta;
+static vector<uint8_t> g_free_map;
+static vector<uint32_t> g_next;          // cached next pointer of every block, [0] unused
+static vector<uint32_t> g_meta_gen;      // bumped on every metadata write, lets defrag spot races
+static map<string,uint32_t> g_path_index;
+static recursive_mutex g_fs_mutex;
+
+static map<uint32_t,UploadSession> g_uploads;
+static uint32_t g_next_upload = 1;
+
+static bool g_txn = false;
+static vector<UndoRec> g_undo;
+static set<uint32_t> g_txn_alloc;       // free when the transaction began, so no pre-image is needed
+static set<uint32_t> g_txn_held;        // in use when the transaction began and freed by it
+static set<uint32_t> g_txn_saved;       // pre-image already in the undo log
+static vector<uint32_t> g_txn_freed;    // punched only once the transaction commits
+static vector<ChangeRec> g_txn_changes;  // reported only once the transaction commits
+static fs_change_hook g_change_hook = NULL;
+
+static OFSRuntimeStats g_rt;
+
+static double compute_fragmentation();
+
+static uint32_t rsv_get32(const OMNIHeader &h, int off) {
+    uint32_t v;
+    memcpy(&v, h.reserved + off, sizeof(v));
+    return v;
+}
+
+static void rsv_set32(OMNIHeader &h, int off, uint32_t v) {
+    memcpy(h.reserved + off, &v, sizeof(v));
+}
+
+static uint64_t align_up(uint64_t v, uint64_t a) {
+    return (v + a - 1) / a * a;
+}
+
+// CRC of a fixed-size record, taken with its own CRC field zeroed
+static uint32_t record_crc(const void* rec, size_t size, size_t crc_off) {
+    vector<char> tmp((const char*)rec, (const char*)rec + size);
+    memset(&tmp[crc_off], 0, 4);
+    return crc32c(tmp.data(), size);
+}
+
+static void seal_record(void* rec, size_t size, size_t crc_off) {
+    uint32_t crc = record_crc(rec, size, crc_off);
+    memcpy((char*)rec + crc_off, &crc, 4);
+}
+
+static bool record_ok(const void* rec, size_t size, size_t crc_off) {
+    uint32_t stored;
+    memcpy(&stored, (const char*)rec + crc_off, 4);
+    return stored == record_crc(rec, size, crc_off);
+}
+
+int config_get_int(const char* config_path, const char* key, int fallback) {
+    ifstream ifs(config_path);
+    if (!ifs.is_open()) return fallback;
+    string line;
+    while (getline(ifs, line)) {
+        size_t hash = line.find('#');
+        if (hash != string::npos) line = line.substr(0, hash);
+        size_t eq = line.find('=');
+        if (eq == string::npos) continue;
+        string k = line.substr(0, eq);
+        k.erase(0, k.find_first_not_of(" \t"));
+        k.erase(k.find_last_not_of(" \t") + 1);
+        if (k == key) return atoi(line.c_str() + eq + 1);
+    }
+    return fallback;
+}
+
 int fs_format(const char* omni_path, const char* config_path) {
     OMNIHeader header;
     memset(&header, 0, sizeof(header));
@@ -20,6 +187,29 @@ int fs_format(const char* omni_path, const char* config_path) {
     header.config_timestamp = (uint64_t)time(NULL);
     header.user_table_offset = (uint32_t)header.header_size;
     header.max_users = 50;
+    uint32_t max_files = 1000;
+    header.file_state_storage_offset = header.user_table_offset + header.max_users * sizeof(UserInfo);
+
+    // layout: header => user table => metadata index => free map => block checksums => content blocks
+    uint64_t map_off = header.file_state_storage_offset + (uint64_t)max_files * sizeof(FileMetadata);
+    uint32_t map_capacity = (uint32_t)(MAX_CONTAINER_SIZE / header.block_size);
+    uint64_t crc_off = align_up(map_off + map_capacity, header.block_size);
+    uint64_t data_off = align_up(crc_off + (uint64_t)map_capacity * 4, header.block_size);
+    uint32_t nblocks = (uint32_t)((header.total_size - data_off) / header.block_size);
+    rsv_set32(header, RSV_MAX_FILES, max_files);
+    rsv_set32(header, RSV_TOTAL_BLOCKS, nblocks);
+    rsv_set32(header, RSV_MAP_CAPACITY, map_capacity);
+    // byte-substitution table: a random permutation of 0..255
+    for (int i = 0; i < 256; ++i) header.reserved[i] = (uint8_t)i;
+    srand((unsigned)time(NULL));
+    for (int i = 255; i > 0; --i) {
+        int j = rand() % (i + 1);
+        uint8_t t = header.reserved[i];
+        header.reserved[i] = header.reserved[j];
+        header.reserved[j] = t;
+    }
+    rsv_set32(header, RSV_FEATURES, FEATURE_CHECKSUMS | FEATURE_ENCODED);
+    seal_record(&header, sizeof(header), HEADER_CRC_OFF);
 
     ofstream ofs(omni_path, ios::binary | ios::trunc);
     if (!ofs.is_open()) {
@@ -39,6 +229,7 @@ int fs_format(const char* omni_path, const char* config_path) {
     admin.created_time = (uint64_t)time(NULL);
     admin.last_login = 0;
     admin.is_active = 1;
+    seal_record(&admin, sizeof(admin), USER_CRC_OFF);
 
     ofs.seekp(header.user_table_offset, ios::beg);
     ofs.write((char*)&admin, sizeof(UserInfo));
@@ -46,9 +237,12 @@ int fs_format(const char* omni_path, const char* config_path) {
         ofs.write((char*)&empty, sizeof(UserInfo));
     }
 
-    uint64_t user_table_size = (uint64_t)header.max_users * sizeof(UserInfo);
-    uint64_t remaining = header.total_size - header.header_size - user_table_size;
-    uint32_t nblocks = (uint32_t)(remaining / header.block_size);
+    FileMetadata empty_meta;
+    memset(&empty_meta, 0, sizeof(FileMetadata));
+    for (uint32_t i = 0; i < max_files; ++i) {
+        ofs.write((char*)&empty_meta, sizeof(FileMetadata));
+    }
+
     vector<char> free_map(nblocks, 0);
     ofs.write(free_map.data(), free_map.size());
 
@@ -74,6 +268,11 @@ int fs_init(const char* omni_path) {
         ifs.close();
         return -1;
     }
+    if ((rsv_get32(header, RSV_FEATURES) & FEATURE_CHECKSUMS) && !record_ok(&header, sizeof(header), HEADER_CRC_OFF)) {
+        cout << "Corrupt omni header (checksum mismatch)\n";
+        ifs.close();
+        return -1;
+    }
     ifs.seekg(header.user_table_offset, ios::beg);
     UserInfo u;
     ifs.read((char*)&u, sizeof(UserInfo));
@@ -81,6 +280,124 @@ int fs_init(const char* omni_path) {
         cout << "[fs_init] loaded 1 users, blocks=" << (header.total_size / header.block_size) << "\n";
     }
     ifs.close();
+
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    if (g_omni.is_open()) g_omni.close();
+    g_omni.open(omni_path, ios::binary | ios::in | ios::out);
+    if (!g_omni.is_open()) return -1;
+    if (g_omni_fd >= 0) close(g_omni_fd);
+    g_omni_fd = open(omni_path, O_RDWR);
+    g_omni_path = omni_path;
+    g_hdr = header;
+    g_max_files = rsv_get32(header, RSV_MAX_FILES);
+    g_nblocks = rsv_get32(header, RSV_TOTAL_BLOCKS);
+    g_map_capacity = rsv_get32(header, RSV_MAP_CAPACITY);
+    if (g_map_capacity < g_nblocks) g_map_capacity = g_nblocks;
+    g_map_off = header.file_state_storage_offset + (uint64_t)g_max_files * sizeof(FileMetadata);
+    g_checksums = (rsv_get32(header, RSV_FEATURES) & FEATURE_CHECKSUMS) != 0;
+    g_encoded = (rsv_get32(header, RSV_FEATURES) & FEATURE_ENCODED) != 0;
+    if (g_encoded) {
+        bool seen[256] = { false };
+        for (int i = 0; i < 256; ++i) {
+            g_enc[i] = header.reserved[i];
+            g_dec[g_enc[i]] = (uint8_t)i;
+            seen[g_enc[i]] = true;
+        }
+        for (int i = 0; i < 256; ++i) {
+            if (!seen[i]) {
+                cout << "Invalid substitution table in header\n";
+                g_omni.close();
+                return -1;
+            }
+        }
+    }
+    g_crc_off = align_up(g_map_off + g_map_capacity, header.block_size);
+    g_data_off = g_checksums ? align_up(g_crc_off + (uint64_t)g_map_capacity * 4, header.block_size) : g_crc_off;
+
+    g_meta.assign(g_max_files, FileMetadata());
+    g_omni.seekg(header.file_state_storage_offset, ios::beg);
+    g_omni.read((char*)g_meta.data(), (std::streamsize)g_max_files * sizeof(FileMetadata));
+    g_free_map.assign(g_nblocks, 0);
+    g_omni.seekg((std::streamoff)g_map_off, ios::beg);
+    g_omni.read((char*)g_free_map.data(), g_nblocks);
+    if (!g_omni) {
+        g_omni.close();
+        return -1;
+    }
+
+    g_crc.assign(g_nblocks + 1, 0);
+    if (g_checksums) {
+        g_omni.seekg((std::streamoff)g_crc_off, ios::beg);
+        g_omni.read((char*)&g_crc[1], (std::streamsize)g_nblocks * 4);
+    }
+    g_bad_blocks.clear();
+    g_unwritten.clear();
+    g_rt = OFSRuntimeStats();
+
+    // a record that fails its checksum is left out of the index rather than trusted
+    g_path_index.clear();
+    for (uint32_t i = 0; i < g_max_files; ++i) {
+        if (!g_meta[i].path[0]) continue;
+        if (g_checksums && !record_ok(&g_meta[i], sizeof(FileMetadata), META_CRC_OFF)) {
+            cout << "[fs_init] metadata record " << i << " failed its checksum, skipped\n";
+            g_rt.bad_records++;
+            continue;
+        }
+        g_path_index[g_meta[i].path] = i;
+    }
+    g_meta_gen.assign(g_max_files, 0);
+
+    g_next.assign(g_nblocks + 1, 0);
+    uint64_t data_off = g_data_off;
+    for (uint32_t b = 1; b <= g_nblocks; ++b) {
+        if (!g_free_map[b - 1]) continue;
+        g_omni.seekg((std::streamoff)(data_off + (uint64_t)(b - 1) * header.block_size), ios::beg);
+        g_omni.read((char*)&g_next[b], 4);
+    }
+    if (!g_omni) {
+        g_omni.close();
+        return -1;
+    }
+
+    // the free map is rebuilt from the metadata chains, so blocks reserved by an upload or
+    // a defrag copy that never committed come back after a crash. Records that failed their
+    // checksum still keep their chains, a leak is better than handing their blocks out.
+    vector<uint8_t> reached(g_nblocks, 0);
+    for (uint32_t i = 0; i < g_max_files; ++i) {
+        const FileMetadata &m = g_meta[i];
+        if (!m.path[0] || m.entry.getType() != EntryType::FILE || (m.reserved[META_FLAGS] & META_INLINE)) continue;
+        uint32_t b = m.entry.inode;
+        while (b != 0 && b <= g_nblocks && !reached[b - 1]) {
+            reached[b - 1] = 1;
+            if (!g_free_map[b - 1]) {
+                g_omni.seekg((std::streamoff)(data_off + (uint64_t)(b - 1) * header.block_size), ios::beg);
+                g_omni.read((char*)&g_next[b], 4);
+            }
+            b = g_next[b];
+        }
+    }
+    uint32_t released = 0, claimed = 0;
+    for (uint32_t b = 1; b <= g_nblocks; ++b) {
+        if (g_free_map[b - 1] == reached[b - 1]) continue;
+        if (reached[b - 1]) {
+            claimed++;
+        } else {
+            released++;
+            g_next[b] = 0;
+        }
+        g_free_map[b - 1] = reached[b - 1];
+    }
+    if (released || claimed) {
+        g_omni.clear();
+        g_omni.seekp((std::streamoff)g_map_off, ios::beg);
+        g_omni.write((char*)g_free_map.data(), g_nblocks);
+        g_omni.flush();
+        cout << "[fs_init] free map rebuilt: " << released << " unreferenced blocks released, " << claimed << " referenced blocks reclaimed\n";
+    }
+    if (!g_omni) {
+        g_omni.close();
+        return -1;
+    }
     return 0;
 }
 
@@ -98,6 +415,10 @@ int verify_user(const char* username, const char* password) {
         UserInfo u;
         ifs.read((char*)&u, sizeof(u));
         if (!ifs) break;
+        if ((rsv_get32(hdr, RSV_FEATURES) & FEATURE_CHECKSUMS) && u.is_active &&
+            !record_ok(&u, sizeof(u), USER_CRC_OFF)) {
+            continue;
+        }
         if (u.is_active) {
             string uname(u.username);
             if (uname == string(username)) {
@@ -118,19 +439,1125 @@ int verify_user(const char* username, const char* password) {
 
 int get_stats(FSStats* out) {
     if (!out) return -1;
-    ifstream ifs("compiled/sample.omni", ios::binary);
-    if (!ifs.is_open()) return -1;
-    OMNIHeader hdr;
-    ifs.read((char*)&hdr, sizeof(hdr));
-    ifs.close();
-    if (strncmp(hdr.magic, "OMNIFS01", 8) != 0) return -1;
-    out->total_size = hdr.total_size;
-    out->used_space = 0;
-    out->free_space = hdr.total_size - hdr.header_size;
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    if (!g_omni.is_open()) return -1;
+    uint64_t used_blocks = 0;
+    for (uint32_t b = 0; b < g_nblocks; ++b) {
+        if (g_free_map[b]) used_blocks++;
+    }
+    out->total_size = g_hdr.total_size;
+    out->used_space = used_blocks * g_hdr.block_size;
+    out->free_space = (uint64_t)(g_nblocks - used_blocks) * g_hdr.block_size;
     out->total_files = 0;
     out->total_directories = 0;
-    out->total_users = hdr.max_users;
+    out->logical_bytes = 0;
+    out->physical_bytes = 0;
+    for (uint32_t i = 0; i < g_max_files; ++i) {
+        if (!g_meta[i].path[0]) continue;
+        if (g_meta[i].entry.getType() == EntryType::DIRECTORY) {
+            out->total_directories++;
+        } else {
+            out->total_files++;
+            out->logical_bytes += g_meta[i].entry.size;
+            out->physical_bytes += g_meta[i].actual_size;
+        }
+    }
+    out->total_users = g_hdr.max_users;
     out->active_sessions = 0;
-    out->fragmentation = 0.0;
+    out->fragmentation = compute_fragmentation();
+    return 0;
+}
+
+// ---- block and metadata I/O ----
+
+static uint32_t payload_size() {
+    return (uint32_t)g_hdr.block_size - 4;
+}
+
+static uint64_t block_pos(uint32_t b) {
+    return g_data_off + (uint64_t)(b - 1) * g_hdr.block_size;
+}
+
+// false if the block does not match its stored checksum; it is then remembered as bad
+static bool read_block(uint32_t b, char* buf) {
+    g_omni.seekg((std::streamoff)block_pos(b), ios::beg);
+    g_omni.read(buf, (std::streamsize)g_hdr.block_size);
+    if (!g_omni) {
+        g_omni.clear();
+        return false;
+    }
+    // the next pointer is stored plain; the payload is checked as stored, then decoded
+    uint8_t* p = (uint8_t*)buf;
+    size_t payload = g_hdr.block_size - 4;
+    uint32_t crc = 0;
+    if (g_encoded && g_checksums) crc = subst_apply_crc_in(g_dec, p + 4, p + 4, payload, crc32c(p, 4));
+    else if (g_encoded) subst_apply(g_dec, p + 4, p + 4, payload);
+    else if (g_checksums) crc = crc32c(p, g_hdr.block_size);
+    if (g_checksums && crc != g_crc[b] && !g_unwritten.count(b)) {
+        g_bad_blocks.insert(b);
+        return false;
+    }
+    return true;
+}
+
+static void write_block(uint32_t b, const char* buf) {
+    // only the first pre-image matters: abort replays the log backwards
+    if (g_txn && !g_txn_alloc.count(b) && g_txn_saved.insert(b).second) {
+        UndoRec u;
+        u.kind = 2;
+        u.index = b;
+        u.bytes.resize(g_hdr.block_size);
+        read_block(b, &u.bytes[0]);
+        g_undo.push_back(u);
+    }
+    const char* out = buf;
+    uint32_t crc = 0;
+    if (g_encoded) {
+        g_enc_buf.resize(g_hdr.block_size);
+        uint8_t* e = (uint8_t*)&g_enc_buf[0];
+        size_t payload = g_hdr.block_size - 4;
+        memcpy(e, buf, 4);
+        if (g_checksums) crc = subst_apply_crc_out(g_enc, (const uint8_t*)buf + 4, e + 4, payload, crc32c(e, 4));
+        else subst_apply(g_enc, (const uint8_t*)buf + 4, e + 4, payload);
+        out = &g_enc_buf[0];
+    } else if (g_checksums) {
+        crc = crc32c(buf, g_hdr.block_size);
+    }
+
+    g_omni.seekp((std::streamoff)block_pos(b), ios::beg);
+    g_omni.write(out, (std::streamsize)g_hdr.block_size);
+    memcpy(&g_next[b], buf, 4);
+    if (g_checksums) {
+        g_crc[b] = crc;
+        g_omni.seekp((std::streamoff)(g_crc_off + (uint64_t)(b - 1) * 4), ios::beg);
+        g_omni.write((char*)&g_crc[b], 4);
+        g_bad_blocks.erase(b);
+    }
+    g_unwritten.erase(b);
+}
+
+static void set_block_used(uint32_t b, bool used) {
+    if (g_txn) {
+        UndoRec u;
+        u.kind = 1;
+        u.index = b;
+        u.bytes.assign(1, (char)g_free_map[b - 1]);
+        g_undo.push_back(u);
+        // a block this transaction freed still holds data that abort must bring back
+        if (used && !g_txn_held.count(b)) g_txn_alloc.insert(b);
+        if (!used && !g_txn_alloc.count(b)) g_txn_held.insert(b);
+    }
+    g_free_map[b - 1] = used ? 1 : 0;
+    g_omni.seekp((std::streamoff)(g_map_off + b - 1), ios::beg);
+    g_omni.write((char*)&g_free_map[b - 1], 1);
+    if (!used) g_unwritten.erase(b);
+}
+
+// takes a free block for new data; it holds whatever was there before until written
+static void reserve_block(uint32_t b) {
+    set_block_used(b, true);
+    g_unwritten.insert(b);
+}
+
+static void punch_runs(vector<uint32_t> blocks) {
+    if (g_omni_fd < 0 || blocks.empty()) return;
+    sort(blocks.begin(), blocks.end());
+    g_omni.flush();
+    size_t start = 0;
+    for (size_t i = 1; i <= blocks.size(); ++i) {
+        if (i < blocks.size() && blocks[i] == blocks[i - 1] + 1) continue;
+        uint32_t len = (uint32_t)(i - start);
+        if (len >= PUNCH_MIN_BLOCKS) {
+            fallocate(g_omni_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      (off_t)block_pos(blocks[start]), (off_t)len * g_hdr.block_size);
+        }
+        start = i;
+    }
+}
+
+// marks blocks free and gives large runs back to the host filesystem
+static void free_blocks(const vector<uint32_t> &blocks) {
+    for (size_t i = 0; i < blocks.size(); ++i) set_block_used(blocks[i], false);
+    if (g_txn) g_txn_freed.insert(g_txn_freed.end(), blocks.begin(), blocks.end());
+    else punch_runs(blocks);
+}
+
+static void put_meta(uint32_t idx, const FileMetadata &m) {
+    if (g_txn) {
+        UndoRec u;
+        u.kind = 0;
+        u.index = idx;
+        u.bytes.assign((const char*)&g_meta[idx], sizeof(FileMetadata));
+        g_undo.push_back(u);
+    }
+    if (g_meta[idx].path[0]) g_path_index.erase(g_meta[idx].path);
+    g_meta[idx] = m;
+    if (m.path[0]) seal_record(&g_meta[idx], sizeof(FileMetadata), META_CRC_OFF);
+    g_meta_gen[idx]++;
+    if (m.path[0]) g_path_index[m.path] = idx;
+    g_omni.seekp((std::streamoff)(g_hdr.file_state_storage_offset + (uint64_t)idx * sizeof(FileMetadata)), ios::beg);
+    g_omni.write((const char*)&g_meta[idx], sizeof(FileMetadata));
+}
+
+static void sync_if_idle() {
+    if (!g_txn) g_omni.flush();
+}
+
+// ---- allocation ----
+
+// prefers one contiguous run of n blocks, otherwise takes the first n free blocks
+static bool alloc_blocks(uint32_t n, vector<uint32_t> &out) {
+    out.clear();
+    if (n == 0) return true;
+    uint32_t run = 0;
+    for (uint32_t b = 1; b <= g_nblocks; ++b) {
+        run = g_free_map[b - 1] ? 0 : run + 1;
+        if (run == n) {
+            for (uint32_t k = b - n + 1; k <= b; ++k) out.push_back(k);
+            break;
+        }
+    }
+    if (out.empty()) {
+        for (uint32_t b = 1; b <= g_nblocks && out.size() < n; ++b) {
+            if (!g_free_map[b - 1]) out.push_back(b);
+        }
+        if (out.size() < n) {
+            out.clear();
+            return false;
+        }
+    }
+    for (size_t i = 0; i < out.size(); ++i) reserve_block(out[i]);
+    return true;
+}
+
+static uint32_t next_of(const char* block) {
+    uint32_t next;
+    memcpy(&next, block, 4);
+    return next;
+}
+
+static vector<uint32_t> chain_of(const FileMetadata &m) {
+    vector<uint32_t> blocks;
+    uint32_t b = m.entry.inode;
+    while (b != 0 && b <= g_nblocks && blocks.size() < g_nblocks) {
+        blocks.push_back(b);
+        b = g_next[b];
+    }
+    return blocks;
+}
+
+// reads len bytes of the stored stream from off, touching only the blocks that hold them
+static bool read_stored(const FileMetadata &m, uint64_t off, size_t len, char* out) {
+    uint32_t b = m.entry.inode;
+    for (uint64_t skip = off / payload_size(); skip > 0 && b != 0 && b <= g_nblocks; --skip) b = g_next[b];
+    vector<char> buf(g_hdr.block_size);
+    size_t in_block = (size_t)(off % payload_size());
+    size_t done = 0;
+    while (done < len) {
+        if (b == 0 || b > g_nblocks || !read_block(b, buf.data())) return false;
+        size_t take = min((size_t)payload_size() - in_block, len - done);
+        memcpy(out + done, buf.data() + 4 + in_block, take);
+        done += take;
+        in_block = 0;
+        b = next_of(buf.data());
+    }
+    return true;
+}
+
+static uint32_t chunk_count(uint64_t size) {
+    return (uint32_t)((size + COMP_CHUNK - 1) / COMP_CHUNK);
+}
+
+// decodes the logical range [off, off+len) of a compressed file; the extents of
+// consecutive chunks are adjacent, so the touched ones are read in one pass
+static bool read_extents(const FileMetadata &m, uint64_t off, size_t len, char* out) {
+    if (len == 0) return true;
+    uint32_t first = (uint32_t)(off / COMP_CHUNK);
+    uint32_t last = (uint32_t)((off + len - 1) / COMP_CHUNK);
+    uint64_t map_bytes = (uint64_t)chunk_count(m.entry.size) * 8;
+    vector<uint32_t> ext((last - first + 1) * 2);
+    if (!read_stored(m, (uint64_t)first * 8, ext.size() * 4, (char*)ext.data())) return false;
+
+    uint64_t span_start = ext[0];
+    uint64_t span_end = (uint64_t)ext[ext.size() - 2] + (ext[ext.size() - 1] & ~EXTENT_RAW);
+    if (span_end < span_start || map_bytes + span_end > m.actual_size) return false;
+    vector<char> span(span_end - span_start);
+    if (!read_stored(m, map_bytes + span_start, span.size(), span.data())) return false;
+
+    vector<char> plain(COMP_CHUNK);
+    for (uint32_t c = first; c <= last; ++c) {
+        uint64_t c_start = (uint64_t)c * COMP_CHUNK;
+        size_t c_len = (size_t)min((uint64_t)COMP_CHUNK, m.entry.size - c_start);
+        uint32_t e_off = ext[(c - first) * 2];
+        uint32_t e_len = ext[(c - first) * 2 + 1] & ~EXTENT_RAW;
+        bool raw = (ext[(c - first) * 2 + 1] & EXTENT_RAW) != 0;
+        if (e_off < span_start || e_off + (uint64_t)e_len > span_end) return false;
+        const char* src = span.data() + (e_off - span_start);
+        if (raw) {
+            if (e_len != c_len) return false;
+            memcpy(plain.data(), src, c_len);
+        } else if (!lz4_decompress((const uint8_t*)src, e_len, (uint8_t*)plain.data(), c_len)) {
+            return false;
+        }
+        uint64_t from = max(off, c_start);
+        uint64_t to = min(off + len, c_start + c_len);
+        memcpy(out + (from - off), plain.data() + (from - c_start), (size_t)(to - from));
+    }
+    return true;
+}
+
+static bool read_range(const FileMetadata &m, uint64_t off, size_t len, string &out) {
+    if (m.reserved[META_FLAGS] & META_INLINE) {
+        out.assign(m.path + INLINE_OFF + off, len);
+        return true;
+    }
+    out.assign(len, '\0');
+    if (len == 0) return true;
+    if (m.reserved[META_FLAGS] & META_COMPRESSED) return read_extents(m, off, len, &out[0]);
+    return read_stored(m, off, len, &out[0]);
+}
+
+static bool read_content(const FileMetadata &m, string &out) {
+    return read_range(m, 0, (size_t)m.entry.size, out);
+}
+
+// extent map followed by the extents; chunks that do not shrink by an eighth are kept raw.
+// Returns false when the whole file would not shrink by a sixteenth, so it is stored plain.
+static bool pack_content(const string &content, string &packed) {
+    uint32_t n = chunk_count(content.size());
+    vector<uint32_t> ext(n * 2);
+    string body;
+    vector<uint8_t> tmp(COMP_CHUNK);
+    for (uint32_t c = 0; c < n; ++c) {
+        size_t c_len = min((size_t)COMP_CHUNK, content.size() - (size_t)c * COMP_CHUNK);
+        const uint8_t* src = (const uint8_t*)content.data() + (size_t)c * COMP_CHUNK;
+        size_t z = lz4_compress(src, c_len, tmp.data(), c_len - c_len / 8);
+        ext[c * 2] = (uint32_t)body.size();
+        if (z) {
+            ext[c * 2 + 1] = (uint32_t)z;
+            body.append((const char*)tmp.data(), z);
+        } else {
+            ext[c * 2 + 1] = (uint32_t)c_len | EXTENT_RAW;
+            body.append((const char*)src, c_len);
+        }
+    }
+    if (ext.size() * 4 + body.size() >= content.size() - content.size() / 16) return false;
+    packed.assign((const char*)ext.data(), ext.size() * 4);
+    packed += body;
+    return true;
+}
+
+// rewrites the file's chain with content, growing or shrinking it as needed
+static int write_content(FileMetadata &m, const string &content) {
+    if (content.size() <= INLINE_MAX && strlen(m.path) < INLINE_OFF) {
+        free_blocks(chain_of(m));
+        memset(m.path + INLINE_OFF, 0, INLINE_MAX);
+        memcpy(m.path + INLINE_OFF, content.data(), content.size());
+        m.reserved[META_FLAGS] = (m.reserved[META_FLAGS] & ~META_COMPRESSED) | META_INLINE;
+        m.entry.inode = 0;
+        m.entry.size = content.size();
+        m.actual_size = content.size();
+        m.blocks_used = 0;
+        m.entry.modified_time = (uint64_t)time(NULL);
+        return 0;
+    }
+    if (m.reserved[META_FLAGS] & META_INLINE) {
+        memset(m.path + INLINE_OFF, 0, INLINE_MAX);
+        m.reserved[META_FLAGS] &= ~META_INLINE;
+    }
+
+    const string* stored = &content;
+    string packed;
+    m.reserved[META_FLAGS] &= ~META_COMPRESSED;
+    if ((m.reserved[META_FLAGS] & META_COMPRESS) && pack_content(content, packed)) {
+        stored = &packed;
+        m.reserved[META_FLAGS] |= META_COMPRESSED;
+    }
+
+    vector<uint32_t> blocks = chain_of(m);
+    uint32_t need = (uint32_t)((stored->size() + payload_size() - 1) / payload_size());
+    if (need > blocks.size()) {
+        vector<uint32_t> extra;
+        if (!alloc_blocks(need - (uint32_t)blocks.size(), extra)) {
+            return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+        }
+        blocks.insert(blocks.end(), extra.begin(), extra.end());
+    }
+    if (blocks.size() > need) {
+        free_blocks(vector<uint32_t>(blocks.begin() + need, blocks.end()));
+        blocks.resize(need);
+    }
+
+    vector<char> buf(g_hdr.block_size);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        memset(buf.data(), 0, buf.size());
+        uint32_t next = (i + 1 < blocks.size()) ? blocks[i + 1] : 0;
+        memcpy(buf.data(), &next, 4);
+        size_t off = i * payload_size();
+        size_t take = min((size_t)payload_size(), stored->size() - off);
+        memcpy(buf.data() + 4, stored->data() + off, take);
+        write_block(blocks[i], buf.data());
+    }
+
+    m.entry.inode = blocks.empty() ? 0 : blocks[0];
+    m.entry.size = content.size();
+    m.actual_size = stored->size();
+    m.blocks_used = blocks.size();
+    m.entry.modified_time = (uint64_t)time(NULL);
+    return 0;
+}
+
+// overwrites or extends a plain file in its chain, rewriting only the blocks the
+// edit touches and, when the chain grows, the old last block to link it
+static int edit_blocks(FileMetadata &m, uint64_t index, const char* data, size_t size) {
+    m.entry.modified_time = (uint64_t)time(NULL);
+    if (size == 0) return 0;
+    vector<uint32_t> blocks = chain_of(m);
+    uint32_t ps = payload_size();
+    uint64_t new_size = max((uint64_t)m.entry.size, index + size);
+    uint32_t old_count = (uint32_t)blocks.size();
+    uint32_t need = (uint32_t)((new_size + ps - 1) / ps);
+    uint32_t first = (uint32_t)(index / ps);
+    uint32_t last = (uint32_t)((index + size - 1) / ps);
+    if (need > old_count && old_count > 0) first = min(first, old_count - 1);
+
+    // read everything first so a bad block leaves the file untouched
+    vector<char> buf((size_t)(last - first + 1) * g_hdr.block_size, 0);
+    for (uint32_t i = first; i <= last && i < old_count; ++i) {
+        if (!read_block(blocks[i], &buf[(size_t)(i - first) * g_hdr.block_size])) {
+            return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        }
+    }
+    if (need > old_count) {
+        vector<uint32_t> extra;
+        if (!alloc_blocks(need - old_count, extra)) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+        blocks.insert(blocks.end(), extra.begin(), extra.end());
+    }
+
+    for (uint32_t i = first; i <= last; ++i) {
+        char* p = &buf[(size_t)(i - first) * g_hdr.block_size];
+        uint32_t next = (i + 1 < blocks.size()) ? blocks[i + 1] : 0;
+        memcpy(p, &next, 4);
+        uint64_t from = max(index, (uint64_t)i * ps);
+        uint64_t to = min(index + size, (uint64_t)(i + 1) * ps);
+        if (from < to) memcpy(p + 4 + (from - (uint64_t)i * ps), data + (from - index), (size_t)(to - from));
+        write_block(blocks[i], p);
+    }
+
+    m.entry.inode = blocks[0];
+    m.entry.size = new_size;
+    m.actual_size = new_size;
+    m.blocks_used = blocks.size();
+    return 0;
+}
+
+// ---- paths ----
+
+static bool valid_path(const string &path) {
+    if (path.size() < 2 || path[0] != '/' || path[path.size() - 1] == '/') return false;
+    if (path.size() >= sizeof(((FileMetadata*)0)->path)) return false;
+    return path.find("//") == string::npos;
+}
+
+static string parent_of(const string &path) {
+    size_t pos = path.rfind('/');
+    return pos == 0 ? "/" : path.substr(0, pos);
+}
+
+static bool is_dir(const string &path) {
+    if (path == "/") return true;
+    map<string,uint32_t>::iterator it = g_path_index.find(path);
+    return it != g_path_index.end() && g_meta[it->second].entry.getType() == EntryType::DIRECTORY;
+}
+
+static int free_slot() {
+    for (uint32_t i = 0; i < g_max_files; ++i) {
+        if (!g_meta[i].path[0]) return (int)i;
+    }
+    return -1;
+}
+
+static int create_entry(const char* owner, const string &path, EntryType type, uint32_t perms, uint32_t &idx) {
+    if (!g_omni.is_open()) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    if (!valid_path(path)) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    if (g_path_index.count(path)) return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
+    if (!is_dir(parent_of(path))) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    int slot = free_slot();
+    if (slot < 0) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    idx = (uint32_t)slot;
+
+    string name = path.substr(path.rfind('/') + 1);
+    FileEntry e(name, type, 0, perms, owner ? owner : "", 0);
+    e.created_time = (uint64_t)time(NULL);
+    e.modified_time = e.created_time;
+    FileMetadata m(path, e);
+    put_meta(idx, m);
+    return 0;
+}
+
+static void report_change(const char* kind, const string &path, const string &from = "") {
+    if (g_txn) {
+        ChangeRec c;
+        c.kind = kind;
+        c.path = path;
+        c.from = from;
+        g_txn_changes.push_back(c);
+    } else if (g_change_hook) {
+        g_change_hook(kind, path.c_str(), from.c_str());
+    }
+}
+
+// ---- public file operations ----
+
+void fs_set_change_hook(fs_change_hook hook) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    g_change_hook = hook;
+}
+
+int file_create(const char* owner, const char* path, const char* data, size_t size, bool compress) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    uint32_t idx;
+    int rc = create_entry(owner, path ? path : "", EntryType::FILE, 0644, idx);
+    if (rc != 0) return rc;
+    FileMetadata m = g_meta[idx];
+    if (compress) m.reserved[META_FLAGS] |= META_COMPRESS;
+    rc = write_content(m, string(data ? data : "", size));
+    if (rc != 0) {
+        FileMetadata empty;
+        memset(&empty, 0, sizeof(empty));
+        put_meta(idx, empty);
+        sync_if_idle();
+        return rc;
+    }
+    put_meta(idx, m);
+    sync_if_idle();
+    report_change("create", path);
+    return 0;
+}
+
+int file_read(const char* path, string &out) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    map<string,uint32_t>::iterator it = g_path_index.find(path ? path : "");
+    if (it == g_path_index.end()) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    const FileMetadata &m = g_meta[it->second];
+    if (m.entry.getType() != EntryType::FILE) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    if (!read_content(m, out)) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    return 0;
+}
+
+int file_read_range(const char* path, uint64_t offset, uint64_t len, string &out) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    map<string,uint32_t>::iterator it = g_path_index.find(path ? path : "");
+    if (it == g_path_index.end()) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    const FileMetadata &m = g_meta[it->second];
+    if (m.entry.getType() != EntryType::FILE) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    if (offset > m.entry.size) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    len = min(len, m.entry.size - offset);
+    if (!read_range(m, offset, (size_t)len, out)) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    return 0;
+}
+
+int file_edit(const char* path, const char* data, size_t size, uint32_t index) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    map<string,uint32_t>::iterator it = g_path_index.find(path ? path : "");
+    if (it == g_path_index.end()) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    uint32_t idx = it->second;
+    FileMetadata m = g_meta[idx];
+    if (m.entry.getType() != EntryType::FILE) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    if (index > m.entry.size) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+
+    // a plain file that stays in blocks is patched in place; inline and compressed
+    // files, and edits that move a file between the two forms, are rewritten whole
+    uint64_t new_size = max((uint64_t)m.entry.size, (uint64_t)index + size);
+    bool in_place = !(m.reserved[META_FLAGS] & (META_INLINE | META_COMPRESS)) &&
+                    (new_size > INLINE_MAX || strlen(m.path) >= INLINE_OFF);
+    int rc;
+    if (in_place) {
+        rc = edit_blocks(m, index, data, size);
+    } else {
+        string content;
+        if (!read_content(m, content)) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        if (index + size > content.size()) content.resize(index + size);
+        if (size) memcpy(&content[index], data, size);
+        rc = write_content(m, content);
+    }
+    if (rc != 0) return rc;
+    put_meta(idx, m);
+    sync_if_idle();
+    report_change("edit", path);
+    return 0;
+}
+
+int file_delete(const char* path) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    map<string,uint32_t>::iterator it = g_path_index.find(path ? path : "");
+    if (it == g_path_index.end()) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    uint32_t idx = it->second;
+    if (g_meta[idx].entry.getType() != EntryType::FILE) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+
+    free_blocks(chain_of(g_meta[idx]));
+    FileMetadata empty;
+    memset(&empty, 0, sizeof(empty));
+    put_meta(idx, empty);
+    sync_if_idle();
+    report_change("delete", path);
+    return 0;
+}
+
+int dir_create(const char* owner, const char* path) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    uint32_t idx;
+    int rc = create_entry(owner, path ? path : "", EntryType::DIRECTORY, 0755, idx);
+    sync_if_idle();
+    if (rc == 0) report_change("create", path);
+    return rc;
+}
+
+int set_permissions(const char* path, uint32_t permissions) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    map<string,uint32_t>::iterator it = g_path_index.find(path ? path : "");
+    if (it == g_path_index.end()) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    FileMetadata m = g_meta[it->second];
+    m.entry.permissions = permissions & 0777;
+    m.entry.modified_time = (uint64_t)time(NULL);
+    put_meta(it->second, m);
+    sync_if_idle();
+    report_change("edit", path);
+    return 0;
+}
+
+// moves a file, or a directory with everything under it, to new_path. A small
+// file whose new path no longer leaves room for inline data is moved to blocks.
+int file_rename(const char* old_path, const char* new_path) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    string from = old_path ? old_path : "";
+    string to = new_path ? new_path : "";
+    map<string,uint32_t>::iterator it = g_path_index.find(from);
+    if (it == g_path_index.end()) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    if (!valid_path(to)) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    if (g_path_index.count(to)) return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
+    if (!is_dir(parent_of(to))) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    if (to.compare(0, from.size() + 1, from + "/") == 0) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+
+    vector<uint32_t> moved(1, it->second);
+    if (g_meta[it->second].entry.getType() == EntryType::DIRECTORY) {
+        for (map<string,uint32_t>::iterator c = g_path_index.lower_bound(from + "/");
+             c != g_path_index.end() && c->first.compare(0, from.size() + 1, from + "/") == 0; ++c) {
+            if (to.size() + c->first.size() - from.size() >= sizeof(((FileMetadata*)0)->path)) {
+                return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+            }
+            moved.push_back(c->second);
+        }
+    }
+
+    // a directory move is several record writes, so it runs as one transaction
+    bool own_txn = !g_txn;
+    if (own_txn) fs_txn_begin();
+    int rc = 0;
+    for (size_t i = 0; i < moved.size() && rc == 0; ++i) {
+        FileMetadata m = g_meta[moved[i]];
+        string np = to + string(m.path).substr(from.size());
+        string content;
+        bool spill = (m.reserved[META_FLAGS] & META_INLINE) && np.size() >= INLINE_OFF;
+        if (spill) {
+            read_content(m, content);
+            memset(m.path + INLINE_OFF, 0, INLINE_MAX);
+            m.reserved[META_FLAGS] &= ~META_INLINE;
+        }
+        // an inline file keeps its data in path[INLINE_OFF..], so only the head is rewritten
+        size_t head = (m.reserved[META_FLAGS] & META_INLINE) ? INLINE_OFF : sizeof(m.path);
+        memset(m.path, 0, head);
+        memcpy(m.path, np.data(), np.size());
+        if (i == 0) {
+            string name = np.substr(np.rfind('/') + 1);
+            memset(m.entry.name, 0, sizeof(m.entry.name));
+            strncpy(m.entry.name, name.c_str(), sizeof(m.entry.name) - 1);
+        }
+        if (spill) rc = write_content(m, content);
+        if (rc == 0) put_meta(moved[i], m);
+    }
+    if (rc == 0) report_change("rename", to, from);
+    if (own_txn) {
+        if (rc == 0) fs_txn_commit();
+        else fs_txn_abort();
+    }
+    return rc;
+}
+
+// ---- container growth ----
+
+int fs_grow(uint64_t new_size) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    if (!g_omni.is_open() || g_omni_fd < 0) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    if (new_size <= g_hdr.total_size) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    uint64_t blocks = (new_size - g_data_off) / g_hdr.block_size;
+    if (blocks > g_map_capacity) return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+
+    // extend the host file, then the map, and only then the header that makes the new blocks visible
+    g_omni.flush();
+    uint64_t old_size = g_hdr.total_size;
+    if (fallocate(g_omni_fd, 0, (off_t)old_size, (off_t)(new_size - old_size)) != 0 &&
+        ftruncate(g_omni_fd, (off_t)new_size) != 0) {
+        return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    }
+
+    uint32_t old_blocks = g_nblocks;
+    vector<char> zeros(blocks - old_blocks, 0);
+    g_omni.seekp((std::streamoff)(g_map_off + old_blocks), ios::beg);
+    g_omni.write(zeros.data(), zeros.size());
+    g_omni.flush();
+
+    OMNIHeader hdr = g_hdr;
+    hdr.total_size = new_size;
+    rsv_set32(hdr, RSV_TOTAL_BLOCKS, (uint32_t)blocks);
+    if (g_checksums) seal_record(&hdr, sizeof(hdr), HEADER_CRC_OFF);
+    g_omni.seekp(0, ios::beg);
+    g_omni.write((char*)&hdr, sizeof(hdr));
+    g_omni.flush();
+    if (!g_omni) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+
+    g_hdr = hdr;
+    g_nblocks = (uint32_t)blocks;
+    g_free_map.resize(g_nblocks, 0);
+    g_next.resize(g_nblocks + 1, 0);
+    g_crc.resize(g_nblocks + 1, 0);
+    cout << "[fs_grow] size=" << old_size << " -> " << new_size << " blocks=" << old_blocks << " -> " << g_nblocks << "\n";
+    return 0;
+}
+
+int get_user_role(const char* username, UserRole* role) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    if (!g_omni.is_open() || !username || !role) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    g_omni.seekg(g_hdr.user_table_offset, ios::beg);
+    for (uint32_t i = 0; i < g_hdr.max_users; ++i) {
+        UserInfo u;
+        g_omni.read((char*)&u, sizeof(u));
+        if (!g_omni) break;
+        if (u.is_active && string(u.username) == username) {
+            *role = u.role;
+            return 0;
+        }
+    }
+    g_omni.clear();
+    return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+}
+
+// ---- streaming upload ----
+
+static void release_upload(map<uint32_t,UploadSession>::iterator it) {
+    free_blocks(it->second.blocks);
+    g_uploads.erase(it);
+}
+
+int upload_begin(const char* owner, const char* path, uint64_t size, uint32_t &upload_id) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    if (!g_omni.is_open()) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    string p = path ? path : "";
+    if (!valid_path(p)) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH);
+    if (g_path_index.count(p)) return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
+    if (!is_dir(parent_of(p))) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+
+    time_t now = time(NULL);
+    for (map<uint32_t,UploadSession>::iterator it = g_uploads.begin(); it != g_uploads.end(); ) {
+        map<uint32_t,UploadSession>::iterator cur = it++;
+        if (now - cur->second.last_active > UPLOAD_IDLE_SECONDS) release_upload(cur);
+        else if (cur->second.path == p) return static_cast<int>(OFSErrorCodes::ERROR_FILE_EXISTS);
+    }
+
+    UploadSession up;
+    up.owner = owner ? owner : "";
+    up.path = p;
+    up.size = size;
+    up.received = 0;
+    up.last_active = now;
+    uint64_t need = (size + payload_size() - 1) / payload_size();
+    if (need > g_nblocks || !alloc_blocks((uint32_t)need, up.blocks)) {
+        return static_cast<int>(OFSErrorCodes::ERROR_NO_SPACE);
+    }
+    sync_if_idle();
+    upload_id = g_next_upload++;
+    g_uploads[upload_id] = up;
+    return 0;
+}
+
+int upload_chunk(uint32_t upload_id, uint64_t offset, const char* data, size_t len) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    map<uint32_t,UploadSession>::iterator it = g_uploads.find(upload_id);
+    if (it == g_uploads.end()) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    UploadSession &up = it->second;
+    if (offset != up.received || offset + len > up.size) {
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+
+    vector<char> buf(g_hdr.block_size);
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        size_t bi = (size_t)(pos / payload_size());
+        size_t in_block = (size_t)(pos % payload_size());
+        size_t take = min((size_t)payload_size() - in_block, len - done);
+        if (in_block != 0) {
+            if (!read_block(up.blocks[bi], buf.data())) return static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+        } else {
+            memset(buf.data(), 0, buf.size());
+        }
+        uint32_t next = (bi + 1 < up.blocks.size()) ? up.blocks[bi + 1] : 0;
+        memcpy(buf.data(), &next, 4);
+        memcpy(buf.data() + 4 + in_block, data + done, take);
+        write_block(up.blocks[bi], buf.data());
+        done += take;
+    }
+    up.received += len;
+    up.last_active = time(NULL);
+    return g_omni ? 0 : static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+}
+
+int upload_commit(uint32_t upload_id) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    map<uint32_t,UploadSession>::iterator it = g_uploads.find(upload_id);
+    if (it == g_uploads.end()) return static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND);
+    UploadSession &up = it->second;
+    if (up.received != up.size) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+
+    uint32_t idx;
+    int rc = create_entry(up.owner.c_str(), up.path, EntryType::FILE, 0644, idx);
+    if (rc != 0) {
+        release_upload(it);
+        sync_if_idle();
+        return rc;
+    }
+    FileMetadata m = g_meta[idx];
+    m.entry.inode = up.blocks.empty() ? 0 : up.blocks[0];
+    m.entry.size = up.size;
+    m.actual_size = up.size;
+    m.blocks_used = up.blocks.size();
+    // a small upload is moved into the record like any other small file
+    string small;
+    if (up.size <= INLINE_MAX && strlen(m.path) < INLINE_OFF && read_content(m, small)) write_content(m, small);
+    // data blocks go out before the record that points at them
+    g_omni.flush();
+    put_meta(idx, m);
+    report_change("create", up.path);
+    g_uploads.erase(it);
+    sync_if_idle();
+    return 0;
+}
+
+void upload_abort(uint32_t upload_id) {
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    map<uint32_t,UploadSession>::iterator it = g_uploads.find(upload_id);
+    if (it == g_uploads.end()) return;
+    release_upload(it);
+    sync_if_idle();
+}
+
+// ---- transactions ----
+
+int fs_txn_begin() {
+    g_fs_mutex.lock();
+    if (g_txn) {
+        g_fs_mutex.unlock();
+        return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    }
+    g_txn = true;
+    g_undo.clear();
+    g_txn_alloc.clear();
+    g_txn_held.clear();
+    g_txn_saved.clear();
+    g_txn_freed.clear();
+    g_txn_changes.clear();
+    return 0;
+}
+
+int fs_txn_commit() {
+    if (!g_txn) return static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+    g_txn = false;
+    g_undo.clear();
+    g_txn_alloc.clear();
+    g_txn_held.clear();
+    g_txn_saved.clear();
+    g_omni.flush();
+    punch_runs(g_txn_freed);
+    g_txn_freed.clear();
+    for (size_t i = 0; i < g_txn_changes.size(); ++i) {
+        const ChangeRec &c = g_txn_changes[i];
+        report_change(c.kind.c_str(), c.path, c.from);
+    }
+    g_txn_changes.clear();
+    int rc = g_omni ? 0 : static_cast<int>(OFSErrorCodes::ERROR_IO_ERROR);
+    g_fs_mutex.unlock();
+    return rc;
+}
+
+void fs_txn_abort() {
+    if (!g_txn) return;
+    g_txn = false;
+    for (size_t i = g_undo.size(); i-- > 0; ) {
+        const UndoRec &u = g_undo[i];
+        if (u.kind == 0) {
+            FileMetadata m;
+            memcpy(&m, u.bytes.data(), sizeof(FileMetadata));
+            put_meta(u.index, m);
+        } else if (u.kind == 1) {
+            set_block_used(u.index, u.bytes[0] != 0);
+        } else {
+            write_block(u.index, u.bytes.data());
+        }
+    }
+    g_undo.clear();
+    g_txn_alloc.clear();
+    g_txn_held.clear();
+    g_txn_saved.clear();
+    g_txn_freed.clear();
+    g_txn_changes.clear();
+    g_omni.flush();
+    g_fs_mutex.unlock();
+}
+
+
+// ---- background defragmentation ----
+
+static uint32_t chain_breaks(const vector<uint32_t> &blocks) {
+    uint32_t breaks = 0;
+    for (size_t i = 1; i < blocks.size(); ++i) {
+        if (blocks[i] != blocks[i - 1] + 1) breaks++;
+    }
+    return breaks;
+}
+
+// share of block-to-block links, over all files, that jump instead of running on
+static double compute_fragmentation() {
+    uint64_t links = 0, breaks = 0;
+    for (uint32_t i = 0; i < g_max_files; ++i) {
+        if (!g_meta[i].path[0] || g_meta[i].entry.getType() != EntryType::FILE) continue;
+        vector<uint32_t> blocks = chain_of(g_meta[i]);
+        if (blocks.size() < 2) continue;
+        links += blocks.size() - 1;
+        breaks += chain_breaks(blocks);
+    }
+    return links ? (double)breaks / (double)links : 0.0;
+}
+
+// the free runs in map order; longest[i] is the longest of runs 0..i, so it never decreases
+static void free_runs(vector<uint32_t> &start, vector<uint32_t> &longest) {
+    start.clear();
+    longest.clear();
+    uint32_t run = 0;
+    for (uint32_t b = 1; b <= g_nblocks + 1; ++b) {
+        if (b <= g_nblocks && !g_free_map[b - 1]) {
+            run++;
+            continue;
+        }
+        if (run) {
+            start.push_back(b - run);
+            longest.push_back(longest.empty() ? run : max(longest.back(), run));
+        }
+        run = 0;
+    }
+}
+
+// lowest free run of n blocks that starts before `before`, 0 if none
+static uint32_t lowest_free_run(const vector<uint32_t> &start, const vector<uint32_t> &longest,
+                                uint32_t n, uint32_t before) {
+    size_t i = lower_bound(longest.begin(), longest.end(), n) - longest.begin();
+    if (i == start.size()) return 0;
+    return start[i] < before ? start[i] : 0;
+}
+
+// the most fragmented file that has somewhere contiguous to go; failing that,
+// the highest-placed file that fits lower down, which pushes free space to the end
+static bool defrag_pick(uint32_t &idx, uint32_t &target) {
+    // one map scan per pick; each file then costs a binary search, not another scan
+    vector<uint32_t> run_start, run_longest;
+    free_runs(run_start, run_longest);
+    uint32_t best_breaks = 0, best_first = 0;
+    bool found = false;
+    for (uint32_t i = 0; i < g_max_files; ++i) {
+        if (!g_meta[i].path[0] || g_meta[i].entry.getType() != EntryType::FILE) continue;
+        vector<uint32_t> blocks = chain_of(g_meta[i]);
+        if (blocks.empty()) continue;
+        uint32_t breaks = chain_breaks(blocks);
+        if (found && breaks < best_breaks) continue;
+        if (found && breaks == 0 && best_breaks == 0 && blocks[0] < best_first) continue;
+        uint32_t start = lowest_free_run(run_start, run_longest, (uint32_t)blocks.size(),
+                                         breaks ? g_nblocks + 1 : blocks[0]);
+        if (start == 0) continue;
+        idx = i;
+        target = start;
+        best_breaks = breaks;
+        best_first = blocks[0];
+        found = true;
+    }
+    return found;
+}
+
+// copy-then-switch: the file keeps pointing at its old blocks until every block
+// has been copied, then one metadata write moves it and the old blocks are freed.
+// The lock is dropped between blocks so foreground requests are not held up.
+// The caller has already reserved the target run under the same lock hold that
+// picked it; old and gen are the file's chain and generation at that moment.
+static bool defrag_move(uint32_t idx, uint32_t target, const vector<uint32_t> &old, uint32_t gen,
+                        uint64_t bytes_per_sec) {
+
+    vector<char> buf(g_hdr.block_size);
+    bool ok = true;
+    for (uint32_t k = 0; k < old.size() && ok; ++k) {
+        {
+            lock_guard<recursive_mutex> lock(g_fs_mutex);
+            if (g_meta_gen[idx] != gen) {
+                ok = false;
+                break;
+            }
+            if (!read_block(old[k], buf.data())) {
+                ok = false;
+                break;
+            }
+            uint32_t next = (k + 1 < old.size()) ? target + k + 1 : 0;
+            memcpy(buf.data(), &next, 4);
+            write_block(target + k, buf.data());
+        }
+        if (bytes_per_sec) {
+            this_thread::sleep_for(chrono::microseconds(g_hdr.block_size * 1000000ULL / bytes_per_sec));
+        }
+    }
+
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    g_rt.defrag_active = 0;
+    if (!ok || g_meta_gen[idx] != gen) {
+        vector<uint32_t> reserved;
+        for (uint32_t k = 0; k < old.size(); ++k) reserved.push_back(target + k);
+        free_blocks(reserved);
+        g_omni.flush();
+        return false;
+    }
+    g_omni.flush();
+    FileMetadata m = g_meta[idx];
+    m.entry.inode = target;
+    put_meta(idx, m);
+    free_blocks(old);
+    g_omni.flush();
+    g_rt.defrag_files_moved++;
+    g_rt.defrag_blocks_moved += old.size();
+    return true;
+}
+
+static void defrag_thread_func(uint64_t bytes_per_sec) {
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+    while (true) {
+        uint32_t idx = 0, target = 0, gen = 0;
+        vector<uint32_t> old;
+        bool found;
+        {
+            // pick and reserve under one lock hold, or the worker could take part of the run first
+            lock_guard<recursive_mutex> lock(g_fs_mutex);
+            found = g_omni.is_open() && defrag_pick(idx, target);
+            if (found) {
+                old = chain_of(g_meta[idx]);
+                gen = g_meta_gen[idx];
+                for (uint32_t k = 0; k < old.size(); ++k) reserve_block(target + k);
+                g_rt.defrag_active = 1;
+            } else {
+                g_rt.defrag_passes++;
+            }
+        }
+        if (found) {
+            defrag_move(idx, target, old, gen, bytes_per_sec);
+        } else {
+            this_thread::sleep_for(chrono::seconds(5));
+        }
+    }
+}
+
+void defrag_start(uint64_t bytes_per_sec) {
+    thread t(defrag_thread_func, bytes_per_sec);
+    t.detach();
+}
+
+// ---- background scrubbing ----
+
+// re-reads the on-disk metadata index; a record that rotted on disk is rewritten
+// from the in-memory copy, which was verified when it was loaded or written
+static void scrub_metadata() {
+    FileMetadata rec;
+    for (uint32_t i = 0; i < g_max_files; ++i) {
+        if (!g_meta[i].path[0] || !g_path_index.count(g_meta[i].path)) continue;
+        g_omni.seekg((std::streamoff)(g_hdr.file_state_storage_offset + (uint64_t)i * sizeof(FileMetadata)), ios::beg);
+        g_omni.read((char*)&rec, sizeof(rec));
+        if (!g_omni) {
+            g_omni.clear();
+            return;
+        }
+        if (memcmp(&rec, &g_meta[i], sizeof(rec)) == 0) continue;
+        g_rt.bad_records++;
+        g_omni.seekp((std::streamoff)(g_hdr.file_state_storage_offset + (uint64_t)i * sizeof(FileMetadata)), ios::beg);
+        g_omni.write((char*)&g_meta[i], sizeof(FileMetadata));
+        g_omni.flush();
+    }
+}
+
+static void scrub_thread_func(uint64_t bytes_per_sec) {
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+    vector<char> buf;
+    uint32_t b = 1;
+    while (true) {
+        bool checked = false;
+        {
+            lock_guard<recursive_mutex> lock(g_fs_mutex);
+            if (g_omni.is_open() && g_checksums) {
+                uint32_t scanned = 0;
+                while (b <= g_nblocks && !g_free_map[b - 1] && scanned++ < 4096) b++;
+                if (b > g_nblocks) {
+                    scrub_metadata();
+                    g_rt.scrub_passes++;
+                    b = 1;
+                } else if (g_unwritten.count(b)) {
+                    b++;
+                } else if (g_free_map[b - 1]) {
+                    buf.resize(g_hdr.block_size);
+                    read_block(b, buf.data());
+                    g_rt.scrub_blocks_checked++;
+                    checked = true;
+                    b++;
+                }
+            }
+        }
+        if (checked && bytes_per_sec) {
+            this_thread::sleep_for(chrono::microseconds(g_hdr.block_size * 1000000ULL / bytes_per_sec));
+        } else if (!checked && b == 1) {
+            this_thread::sleep_for(chrono::seconds(5));
+        }
+    }
+}
+
+void scrub_start(uint64_t bytes_per_sec) {
+    thread t(scrub_thread_func, bytes_per_sec);
+    t.detach();
+}
+
+int get_runtime_stats(OFSRuntimeStats* out) {
+    if (!out) return -1;
+    lock_guard<recursive_mutex> lock(g_fs_mutex);
+    *out = g_rt;
+    out->bad_blocks = (uint32_t)g_bad_blocks.size();
+    uint32_t k = 0;
+    for (set<uint32_t>::iterator it = g_bad_blocks.begin(); it != g_bad_blocks.end() && k < 8; ++it) {
+        out->bad_block_list[k++] = *it;
+    }
+    out->free_extents = 0;
+    out->largest_free_extent = 0;
+    uint32_t run = 0;
+    for (uint32_t b = 1; b <= g_nblocks; ++b) {
+        if (g_free_map[b - 1]) {
+            run = 0;
+            continue;
+        }
+        if (run == 0) out->free_extents++;
+        run++;
+        if (run > out->largest_free_extent) out->largest_free_extent = run;
+    }
+    struct stat st;
+    if (g_omni_fd >= 0 && fstat(g_omni_fd, &st) == 0) {
+        out->disk_usage = (uint64_t)st.st_blocks * 512;
+    }
     return 0;
 }
\ No newline at end of file
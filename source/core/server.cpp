@@ -9,11 +9,19 @@
 #include <sstream>
 #include <cstring>
 #include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdlib>
+#include <random>
 
 #include "../../include/server.hpp"
 #include "../../include/ofs_core.hpp"
 #include "../../include/my_queue.hpp"
 #include "../../include/json_util.hpp"
+#include "../../include/watch.hpp"
 
 using namespace std;
 
@@ -22,9 +30,310 @@ string process_command(const string &raw_json);
 static TSQueue *gqueue = NULL;
 static bool g_running = true;
 
-static void send_json(int client_fd, const string &json) {
-    string msg = json + "\n";
-    send(client_fd, msg.c_str(), msg.size(), 0);
+static const size_t MAX_LINE = 1 << 20;        // longest JSON line a client may send
+static const size_t MAX_FRAME = 1 << 20;       // largest binary upload_chunk payload
+static const size_t MAX_HTTP_BODY = 2 << 20;
+static const int MAX_INFLIGHT = 4;             // queued requests per connection
+static const uint64_t DEFRAG_RATE = 4 << 20;   // bytes/sec the defragmenter may copy
+static const uint64_t SCRUB_RATE = 8 << 20;    // bytes/sec the scrubber may verify
+
+// per-connection back-pressure: the reader stops pulling from the socket while
+// MAX_INFLIGHT of its requests are still waiting for the worker
+struct ConnState {
+    mutex m;
+    condition_variable cv;
+    int inflight;
+    int inflight_class;   // class of the requests in flight, they are all in one queue
+    set<uint32_t> uploads;
+    mutex send_m;      // worker replies and watch pushes share the socket, one line at a time
+    ConnState() : inflight(0), inflight_class(REQ_BULK) {}
+};
+
+struct BridgeReply {
+    mutex m;
+    condition_variable cv;
+    bool done;
+    string json;
+    BridgeReply() : done(false) {}
+};
+
+static uint64_t g_queue_timeout_ms = 30000;
+static atomic<uint64_t> g_shed_expired(0);
+static atomic<uint64_t> g_shed_admission(0);
+
+static mutex g_conns_mutex;
+static map<int, shared_ptr<ConnState> > g_conns;
+
+static shared_ptr<ConnState> find_conn(int fd) {
+    lock_guard<mutex> lock(g_conns_mutex);
+    map<int, shared_ptr<ConnState> >::iterator it = g_conns.find(fd);
+    return it == g_conns.end() ? shared_ptr<ConnState>() : it->second;
+}
+
+static bool send_all(int fd, const string &msg) {
+    size_t sent = 0;
+    while (sent < msg.size()) {
+        ssize_t n = send(fd, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+static bool send_json(int client_fd, const string &json) {
+    shared_ptr<ConnState> conn = find_conn(client_fd);
+    if (!conn) return send_all(client_fd, json + "\n");
+    lock_guard<mutex> lock(conn->send_m);
+    return send_all(client_fd, json + "\n");
+}
+
+static string error_response(const string &op, const string &rid, int code, const string &msg) {
+    ostringstream ss;
+    ss << "{\"status\":\"error\",\"operation\":\"" << op << "\",\"request_id\":\"" << rid << "\",\"error_code\":" << code << ",\"error_message\":\"" << msg << "\"}";
+    return ss.str();
+}
+
+static string stats_response(const string &rid) {
+    FSStats st;
+    OFSRuntimeStats rt;
+    if (get_stats(&st) != 0 || get_runtime_stats(&rt) != 0) {
+        return string("{\"status\":\"error\",\"operation\":\"stats\",\"request_id\":\"") + rid + "\",\"error_message\":\"cannot get stats\"}";
+    }
+    uint32_t watchers;
+    uint64_t resyncs;
+    watch_counts(watchers, resyncs);
+    ostringstream ss;
+    ss << "{\"status\":\"success\",\"operation\":\"stats\",\"request_id\":\"" << rid << "\",\"data\":{\"total_size\":" << st.total_size << ",\"used_space\":" << st.used_space << ",\"free_space\":" << st.free_space
+       << ",\"total_files\":" << st.total_files << ",\"total_directories\":" << st.total_directories << ",\"fragmentation\":" << st.fragmentation
+       << ",\"logical_bytes\":" << st.logical_bytes << ",\"physical_bytes\":" << st.physical_bytes
+       << ",\"watch\":{\"subscribers\":" << watchers << ",\"resyncs\":" << resyncs << "}"
+       << ",\"queue\":{\"wait_p99_ms\":" << gqueue->wait_p99() << ",\"shed_expired\":" << g_shed_expired.load()
+       << ",\"shed_admission\":" << g_shed_admission.load() << "}"
+       << ",\"disk_usage\":" << rt.disk_usage << ",\"free_extents\":" << rt.free_extents << ",\"largest_free_extent\":" << rt.largest_free_extent
+       << ",\"defrag\":{\"active\":" << (rt.defrag_active ? "true" : "false") << ",\"passes\":" << rt.defrag_passes
+       << ",\"files_moved\":" << rt.defrag_files_moved << ",\"blocks_moved\":" << rt.defrag_blocks_moved << "}"
+       << ",\"scrub\":{\"passes\":" << rt.scrub_passes << ",\"blocks_checked\":" << rt.scrub_blocks_checked
+       << ",\"bad_records\":" << rt.bad_records << ",\"bad_blocks\":" << rt.bad_blocks << ",\"bad_block_list\":[";
+    for (uint32_t i = 0; i < rt.bad_blocks && i < 8; ++i) ss << (i ? "," : "") << rt.bad_block_list[i];
+    ss << "]}}}";
+    return ss.str();
+}
+
+static mutex g_sessions_m;
+static map<string,string> g_sessions;   // session id issued by login -> username
+
+static string new_session(const string &user) {
+    random_device rd;
+    ostringstream ss;
+    ss << "sess_" << hex;
+    for (int i = 0; i < 4; ++i) ss << rd();
+    lock_guard<mutex> lock(g_sessions_m);
+    g_sessions[ss.str()] = user;
+    return ss.str();
+}
+
+// the user a login issued sid to, empty if it was not issued or has logged out
+static string logged_in_user(const string &sid) {
+    lock_guard<mutex> lock(g_sessions_m);
+    map<string,string>::iterator it = g_sessions.find(sid);
+    return it == g_sessions.end() ? "" : it->second;
+}
+
+// names the owner of new files; an id that no login issued is still taken as
+// "sess_<user>" or a bare name, so this must not be used to grant anything
+static string session_user(const string &sid) {
+    string user = logged_in_user(sid);
+    if (!user.empty()) return user;
+    return sid.compare(0, 5, "sess_") == 0 ? sid.substr(5) : sid;
+}
+
+static const char* error_text(int code) {
+    switch (static_cast<OFSErrorCodes>(code)) {
+        case OFSErrorCodes::ERROR_NOT_FOUND: return "not found";
+        case OFSErrorCodes::ERROR_PERMISSION_DENIED: return "permission denied";
+        case OFSErrorCodes::ERROR_IO_ERROR: return "io error";
+        case OFSErrorCodes::ERROR_INVALID_PATH: return "invalid path";
+        case OFSErrorCodes::ERROR_FILE_EXISTS: return "file exists";
+        case OFSErrorCodes::ERROR_NO_SPACE: return "no space";
+        case OFSErrorCodes::ERROR_INVALID_SESSION: return "no session";
+        case OFSErrorCodes::ERROR_INVALID_OPERATION: return "invalid operation";
+        case OFSErrorCodes::ERROR_SERVER_BUSY: return "server busy";
+        default: return "error";
+    }
+}
+
+// runs one of the core file/dir commands; returns false if cmd is not one of them
+static bool run_fs_command(const string &cmd, map<string,string> &obj, const string &rid, string &response, int &rc) {
+    string path = obj.count("path") ? obj["path"] : "";
+    string owner = session_user(obj.count("session_id") ? obj["session_id"] : "");
+    string data;
+
+    if (cmd == "file_create") {
+        data = base64_decode(obj.count("data_base64") ? obj["data_base64"] : "");
+        bool compress = obj.count("compress") && obj["compress"] == "true";
+        rc = file_create(owner.c_str(), path.c_str(), data.data(), data.size(), compress);
+    } else if (cmd == "file_edit") {
+        data = base64_decode(obj.count("data_base64") ? obj["data_base64"] : "");
+        uint32_t index = obj.count("index") ? (uint32_t)strtoul(obj["index"].c_str(), NULL, 10) : 0;
+        rc = file_edit(path.c_str(), data.data(), data.size(), index);
+    } else if (cmd == "file_read") {
+        if (obj.count("offset") || obj.count("length")) {
+            uint64_t offset = obj.count("offset") ? strtoull(obj["offset"].c_str(), NULL, 10) : 0;
+            uint64_t length = obj.count("length") ? strtoull(obj["length"].c_str(), NULL, 10) : UINT64_MAX;
+            rc = file_read_range(path.c_str(), offset, length, data);
+        } else {
+            rc = file_read(path.c_str(), data);
+        }
+    } else if (cmd == "file_delete") {
+        rc = file_delete(path.c_str());
+    } else if (cmd == "file_rename") {
+        string from = obj.count("old_path") ? obj["old_path"] : path;
+        path = obj.count("new_path") ? obj["new_path"] : "";
+        rc = file_rename(from.c_str(), path.c_str());
+    } else if (cmd == "dir_create") {
+        rc = dir_create(owner.c_str(), path.c_str());
+    } else if (cmd == "set_permissions") {
+        uint32_t perms = obj.count("permissions") ? (uint32_t)strtoul(obj["permissions"].c_str(), NULL, 8) : 0644;
+        rc = set_permissions(path.c_str(), perms);
+    } else {
+        return false;
+    }
+
+    if (rc != 0) {
+        response = error_response(cmd, rid, rc, error_text(rc));
+    } else if (cmd == "file_read") {
+        response = string("{\"status\":\"success\",\"operation\":\"file_read\",\"request_id\":\"") + rid + "\",\"data\":{\"path\":\"" + path + "\",\"size\":" + to_string(data.size()) + ",\"data_base64\":\"" + base64_encode(data) + "\"}}";
+    } else {
+        response = string("{\"status\":\"success\",\"operation\":\"") + cmd + "\",\"request_id\":\"" + rid + "\",\"data\":{\"path\":\"" + path + "\"}}";
+    }
+    return true;
+}
+
+static string grow_response(map<string,string> &obj, const string &rid) {
+    UserRole role = UserRole::NORMAL;
+    string user = logged_in_user(obj.count("session_id") ? obj["session_id"] : "");
+    if (user.empty()) {
+        return error_response("fs_grow", rid, static_cast<int>(OFSErrorCodes::ERROR_INVALID_SESSION), "needs a session from login");
+    }
+    if (get_user_role(user.c_str(), &role) != 0 || role != UserRole::ADMIN) {
+        return error_response("fs_grow", rid, static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED), "admin only");
+    }
+    uint64_t new_size = obj.count("new_size") ? strtoull(obj["new_size"].c_str(), NULL, 10) : 0;
+    int rc = fs_grow(new_size);
+    if (rc != 0) return error_response("fs_grow", rid, rc, error_text(rc));
+    FSStats st;
+    get_stats(&st);
+    ostringstream ss;
+    ss << "{\"status\":\"success\",\"operation\":\"fs_grow\",\"request_id\":\"" << rid << "\",\"data\":{\"total_size\":" << st.total_size << ",\"free_space\":" << st.free_space << "}}";
+    return ss.str();
+}
+
+// upload_chunk takes its bytes from a binary frame when one followed the line,
+// otherwise from data_base64. An upload belongs to the connection that began it:
+// only that connection may send its chunks or commit it, and closing it aborts the
+// upload. The HTTP bridge has no lasting connection (conn is NULL), so it cannot upload.
+static bool run_upload_command(const string &cmd, map<string,string> &obj, const string &payload,
+                               const string &rid, string &response, ConnState* conn) {
+    if (cmd != "upload_begin" && cmd != "upload_chunk" && cmd != "upload_commit") return false;
+    uint32_t id = obj.count("upload_id") ? (uint32_t)strtoul(obj["upload_id"].c_str(), NULL, 10) : 0;
+    int rc;
+
+    if (!conn) {
+        response = error_response(cmd, rid, static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION), "uploads need a persistent connection");
+        return true;
+    }
+    if (cmd != "upload_begin") {
+        lock_guard<mutex> lock(conn->m);
+        if (!conn->uploads.count(id)) {
+            response = error_response(cmd, rid, static_cast<int>(OFSErrorCodes::ERROR_PERMISSION_DENIED), "not this connection's upload");
+            return true;
+        }
+    }
+
+    if (cmd == "upload_begin") {
+        string path = obj.count("path") ? obj["path"] : "";
+        string owner = session_user(obj.count("session_id") ? obj["session_id"] : "");
+        uint64_t size = obj.count("size") ? strtoull(obj["size"].c_str(), NULL, 10) : 0;
+        rc = upload_begin(owner.c_str(), path.c_str(), size, id);
+        if (rc == 0) {
+            lock_guard<mutex> lock(conn->m);
+            conn->uploads.insert(id);
+        }
+    } else if (cmd == "upload_chunk") {
+        uint64_t offset = obj.count("offset") ? strtoull(obj["offset"].c_str(), NULL, 10) : 0;
+        if (obj.count("length")) {
+            rc = upload_chunk(id, offset, payload.data(), payload.size());
+        } else {
+            string data = base64_decode(obj.count("data_base64") ? obj["data_base64"] : "");
+            rc = upload_chunk(id, offset, data.data(), data.size());
+        }
+    } else {
+        rc = upload_commit(id);
+        if (rc == 0) {
+            lock_guard<mutex> lock(conn->m);
+            conn->uploads.erase(id);
+        }
+    }
+
+    if (rc != 0) {
+        response = error_response(cmd, rid, rc, error_text(rc));
+    } else {
+        response = string("{\"status\":\"success\",\"operation\":\"") + cmd + "\",\"request_id\":\"" + rid + "\",\"data\":{\"upload_id\":" + to_string(id) + "}}";
+    }
+    return true;
+}
+
+// executes ops[] in order as one queue slot and one commit; with "atomic":true
+// the first failing op rolls back everything before it and stops the batch
+static string run_batch(map<string,string> &obj, const string &rid) {
+    vector<string> ops = split_json_array(obj.count("ops") ? obj["ops"] : "");
+    bool atomic = obj.count("atomic") && obj["atomic"] == "true";
+    string sid = obj.count("session_id") ? obj["session_id"] : "";
+
+    if (fs_txn_begin() != 0) {
+        return error_response("batch", rid, static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION), "nested batch");
+    }
+
+    string results;
+    size_t done = 0;
+    bool failed = false;
+    for (size_t i = 0; i < ops.size(); ++i) {
+        map<string,string> op = parse_json_simple(ops[i]);
+        string cmd = op.count("cmd") ? op["cmd"] : (op.count("operation") ? op["operation"] : "");
+        string op_rid = op.count("request_id") ? op["request_id"] : rid + "." + to_string(i);
+        if (!op.count("session_id")) op["session_id"] = sid;
+
+        string response;
+        int rc = 0;
+        bool allowed = cmd == "file_create" || cmd == "file_edit" || cmd == "dir_create" ||
+                       cmd == "file_delete" || cmd == "set_permissions" || cmd == "file_rename";
+        if (!allowed || !run_fs_command(cmd, op, op_rid, response, rc)) {
+            rc = static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION);
+            response = error_response(cmd, op_rid, rc, "not allowed in batch");
+        }
+
+        if (i) results += ",";
+        results += response;
+        done++;
+        if (rc != 0) {
+            failed = true;
+            if (atomic) break;
+        }
+    }
+
+    bool committed = true;
+    if (failed && atomic) {
+        fs_txn_abort();
+        committed = false;
+    } else if (fs_txn_commit() != 0) {
+        committed = false;
+    }
+
+    ostringstream ss;
+    ss << "{\"status\":\"" << (committed && !failed ? "success" : "error") << "\",\"operation\":\"batch\",\"request_id\":\"" << rid
+       << "\",\"data\":{\"total\":" << ops.size() << ",\"executed\":" << done
+       << ",\"committed\":" << (committed ? "true" : "false") << ",\"results\":[" << results << "]}}";
+    return ss.str();
 }
 
 static void worker_thread_func() {
@@ -35,13 +344,19 @@ static void worker_thread_func() {
         string cmd = obj.count("cmd") ? obj["cmd"] : "";
         string rid = obj.count("request_id") ? obj["request_id"] : "0";
         string response;
-
-        if (cmd == "login" || cmd == "user_login") {
+        int rc = 0;
+        shared_ptr<ConnState> conn = find_conn(r.client_fd);
+
+        if (queue_now_ms() > r.deadline_ms) {
+            // the client has given up on this one; answering it would only deepen the backlog
+            g_shed_expired++;
+            response = error_response(cmd, rid, static_cast<int>(OFSErrorCodes::ERROR_SERVER_BUSY), "queue timeout");
+        } else if (cmd == "login" || cmd == "user_login") {
             string u = obj.count("username") ? obj["username"] : "";
             string p = obj.count("password") ? obj["password"] : "";
             int ok = verify_user(u.c_str(), p.c_str());
             if (ok == 0) {
-                response = string("{\"status\":\"success\",\"operation\":\"login\",\"request_id\":\"") + rid + "\",\"data\":{\"message\":\"logged_in\",\"session_id\":\"sess_" + u + "\"}}";
+                response = string("{\"status\":\"success\",\"operation\":\"login\",\"request_id\":\"") + rid + "\",\"data\":{\"message\":\"logged_in\",\"session_id\":\"" + new_session(u) + "\"}}";
             } else {
                 response = string("{\"status\":\"error\",\"operation\":\"login\",\"request_id\":\"") + rid + "\",\"error_code\":-2,\"error_message\":\"Invalid credentials\"}";
             }
@@ -53,57 +368,264 @@ static void worker_thread_func() {
                 response = string("{\"status\":\"success\",\"operation\":\"whoami\",\"request_id\":\"") + rid + ("\",\"data\":{\"session_id\":\"") + sid + "\"}}";
             }
         } else if (cmd == "stats") {
-            FSStats st;
-            if (get_stats(&st) == 0) {
-                ostringstream ss;
-                ss << "{\"status\":\"success\",\"operation\":\"stats\",\"request_id\":\"" << rid << "\",\"data\":{\"total_size\":" << st.total_size << ",\"used_space\":" << st.used_space << ",\"free_space\":" << st.free_space << "}}";
-                response = ss.str();
-            } else {
-                response = string("{\"status\":\"error\",\"operation\":\"stats\",\"request_id\":\"") + rid + "\",\"error_message\":\"cannot get stats\"}";
-            }
+            response = stats_response(rid);
         } else if (cmd == "logout" || cmd == "user_logout") {
+            {
+                lock_guard<mutex> lock(g_sessions_m);
+                g_sessions.erase(obj.count("session_id") ? obj["session_id"] : "");
+            }
             response = string("{\"status\":\"success\",\"operation\":\"logout\",\"request_id\":\"") + rid + "\"}";
         } else if (cmd == "exit") {
             response = string("{\"status\":\"success\",\"operation\":\"exit\",\"request_id\":\"") + rid + "\"}";
-        } else if (cmd == "file_read") {
-            string path = obj.count("path") ? obj["path"] : "";
-            response = string("{\"status\":\"error\",\"operation\":\"file_read\",\"request_id\":\"") + rid + "\",\"error_code\":-8,\"error_message\":\"file_read not implemented in core\"}";
-        } else if (cmd == "file_create") {
-            response = string("{\"status\":\"error\",\"operation\":\"file_create\",\"request_id\":\"") + rid + "\",\"error_code\":-8,\"error_message\":\"file_create not implemented in core\"}";
+        } else if (cmd == "batch") {
+            response = run_batch(obj, rid);
+        } else if (cmd == "fs_grow") {
+            response = grow_response(obj, rid);
         } else if (cmd == "dir_list") {
             string path = obj.count("path") ? obj["path"] : "/";
             response = string("{\"status\":\"success\",\"operation\":\"dir_list\",\"request_id\":\"") + rid + "\",\"data\":{\"path\":\"" + path + "\",\"entries\":[]}}";
+        } else if (run_fs_command(cmd, obj, rid, response, rc)) {
+        } else if (run_upload_command(cmd, obj, r.payload, rid, response, conn.get())) {
         } else {
             response = string("{\"status\":\"error\",\"operation\":\"unknown\",\"request_id\":\"") + rid + "\",\"error_message\":\"unknown command\"}";
         }
 
-        send_json(r.client_fd, response);
+        if (r.reply) {
+            lock_guard<mutex> lock(r.reply->m);
+            r.reply->json = response;
+            r.reply->done = true;
+            r.reply->cv.notify_all();
+        } else {
+            send_json(r.client_fd, response);
+        }
+
+        if (conn) {
+            lock_guard<mutex> lock(conn->m);
+            conn->inflight--;
+            conn->cv.notify_all();
+        }
+    }
+}
+
+static int request_class(const string &cmd) {
+    if (cmd == "login" || cmd == "user_login" || cmd == "logout" || cmd == "user_logout" ||
+        cmd == "whoami" || cmd == "stats" || cmd == "exit") {
+        return REQ_INTERACTIVE;
+    }
+    return REQ_BULK;
+}
+
+// queue_timeout, or the client's timeout_ms if that is shorter
+static uint64_t request_timeout(map<string,string> &obj) {
+    uint64_t timeout = g_queue_timeout_ms;
+    if (obj.count("timeout_ms")) {
+        uint64_t t = strtoull(obj["timeout_ms"].c_str(), NULL, 10);
+        if (t > 0 && t < timeout) timeout = t;
+    }
+    return timeout;
+}
+
+static void submit_request(ConnState &conn, Request &req, map<string,string> &obj) {
+    string cmd = obj.count("cmd") ? obj["cmd"] : "";
+    int cls = request_class(cmd);
+    req.deadline_ms = queue_now_ms() + request_timeout(obj);
+
+    {
+        // interactive requests pass other connections' work, never this one's: behind
+        // this connection's bulk work they queue as bulk, and bulk work waits for its
+        // interactive requests, so a pipelined "file_create; logout" keeps its order
+        unique_lock<mutex> lock(conn.m);
+        if (conn.inflight > 0 && conn.inflight_class == REQ_BULK) cls = REQ_BULK;
+        while (conn.inflight >= MAX_INFLIGHT || (conn.inflight > 0 && conn.inflight_class != cls)) conn.cv.wait(lock);
+        conn.inflight++;
+        conn.inflight_class = cls;
+    }
+    req.req_class = cls;
+    if (!gqueue->try_enqueue(req)) {
+        g_shed_admission++;
+        string rid = obj.count("request_id") ? obj["request_id"] : "0";
+        send_json(req.client_fd, error_response(cmd, rid, static_cast<int>(OFSErrorCodes::ERROR_SERVER_BUSY), "server busy"));
+        lock_guard<mutex> lock(conn.m);
+        conn.inflight--;
+        conn.cv.notify_all();
+    }
+}
+
+// watch/unwatch are answered on the reader thread: they touch no files, so they
+// take no queue slot. Pushes then go out from the subscription's own thread.
+static void run_watch_command(int client_fd, map<string,string> &obj) {
+    string cmd = obj["cmd"];
+    string rid = obj.count("request_id") ? obj["request_id"] : "0";
+    if (cmd == "unwatch") {
+        uint32_t id = obj.count("watch_id") ? (uint32_t)strtoul(obj["watch_id"].c_str(), NULL, 10) : 0;
+        if (!watch_remove(client_fd, id)) {
+            send_json(client_fd, error_response(cmd, rid, static_cast<int>(OFSErrorCodes::ERROR_NOT_FOUND), "not found"));
+            return;
+        }
+        send_json(client_fd, string("{\"status\":\"success\",\"operation\":\"unwatch\",\"request_id\":\"") + rid + "\",\"data\":{\"watch_id\":" + to_string(id) + "}}");
+        return;
     }
+
+    string path = obj.count("path") ? obj["path"] : "/";
+    bool recursive = !obj.count("recursive") || obj["recursive"] != "false";
+    bool stats = obj.count("stats") && obj["stats"] == "true";
+    if (path.empty() || path[0] != '/') {
+        send_json(client_fd, error_response(cmd, rid, static_cast<int>(OFSErrorCodes::ERROR_INVALID_PATH), "invalid path"));
+        return;
+    }
+    uint32_t id = watch_add(client_fd, path, recursive, stats, [client_fd](const string &event, const string &json) {
+        return event == "ping" || send_json(client_fd, json);
+    });
+    send_json(client_fd, string("{\"status\":\"success\",\"operation\":\"watch\",\"request_id\":\"") + rid + "\",\"data\":{\"watch_id\":" + to_string(id) + ",\"path\":\"" + path + "\"}}");
+    thread t(watch_run, id);
+    t.detach();
 }
 
 static void client_reader(int client_fd) {
-    const int BUF = 4096;
-    char buffer[BUF];
+    const int BUF = 65536;
+    vector<char> buffer(BUF);
     string partial = "";
+    shared_ptr<ConnState> conn(new ConnState());
+    {
+        lock_guard<mutex> lock(g_conns_mutex);
+        g_conns[client_fd] = conn;
+    }
+
+    Request pending;
+    map<string,string> pending_obj;
+    size_t want = 0;       // bytes still owed to a binary upload_chunk frame
+    bool framing = false;
+    bool drop = false;
     while (true) {
-        ssize_t bytes = recv(client_fd, buffer, BUF-1, 0);
-        if (bytes <= 0) {
-            close(client_fd);
-            return;
-        }
-        buffer[bytes] = 0;
-        partial += string(buffer);
-        size_t pos;
-        while ((pos = partial.find('\n')) != string::npos) {
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            if (framing) {
+                if (partial.size() >= want) {
+                    pending.payload = partial.substr(0, want);
+                    partial.erase(0, want);
+                    framing = false;
+                    submit_request(*conn, pending, pending_obj);
+                    progress = true;
+                }
+                continue;
+            }
+            size_t pos = partial.find('\n');
+            if (pos == string::npos) break;
             string line = partial.substr(0, pos);
             partial.erase(0, pos+1);
+            progress = true;
             if (line.size() == 0) continue;
             Request req;
             req.client_fd = client_fd;
             req.json = line;
-            gqueue->enqueue(req);
+            map<string,string> obj = parse_json_simple(line);
+            if (obj.count("cmd") && obj["cmd"] == "upload_chunk") {
+                if (obj.count("length")) {
+                    want = (size_t)strtoull(obj["length"].c_str(), NULL, 10);
+                    if (want > MAX_FRAME) {
+                        send_json(client_fd, error_response("upload_chunk", obj["request_id"], static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION), "frame too large"));
+                        drop = true;
+                        break;
+                    }
+                    pending = req;
+                    pending_obj = obj;
+                    framing = true;
+                    continue;
+                }
+            }
+            if (obj.count("cmd") && (obj["cmd"] == "watch" || obj["cmd"] == "unwatch")) {
+                run_watch_command(client_fd, obj);
+                continue;
+            }
+            submit_request(*conn, req, obj);
+        }
+        if (drop) break;
+
+        if (!framing && partial.size() > MAX_LINE) {
+            send_json(client_fd, error_response("unknown", "0", static_cast<int>(OFSErrorCodes::ERROR_INVALID_OPERATION), "request line too long"));
+            break;
         }
+
+        ssize_t bytes = recv(client_fd, buffer.data(), BUF, 0);
+        if (bytes <= 0) break;
+        partial.append(buffer.data(), bytes);
     }
+
+    // the worker may still answer queued requests on this fd, so wait for them
+    // before the fd can be reused, then drop any upload that never committed
+    {
+        unique_lock<mutex> lock(conn->m);
+        while (conn->inflight > 0) conn->cv.wait(lock);
+    }
+    // a watch sender may be blocked writing to a client that stopped reading
+    shutdown(client_fd, SHUT_RDWR);
+    watch_remove_owner(client_fd);
+    for (set<uint32_t>::iterator it = conn->uploads.begin(); it != conn->uploads.end(); ++it) {
+        upload_abort(*it);
+    }
+    {
+        lock_guard<mutex> lock(g_conns_mutex);
+        g_conns.erase(client_fd);
+    }
+    close(client_fd);
+}
+
+static string url_decode(const string &in) {
+    string out;
+    for (size_t i = 0; i < in.size(); ++i) {
+        if (in[i] == '%' && i + 2 < in.size()) {
+            out += (char)strtol(in.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        } else {
+            out += in[i] == '+' ? ' ' : in[i];
+        }
+    }
+    return out;
+}
+
+// Server-Sent Events: GET /watch?path=/docs&recursive=false&stats=true keeps the
+// connection open and pushes the same messages as the watch command
+static void start_sse_watch(int client_fd, const string &first_line) {
+    map<string,string> q;
+    size_t qs = first_line.find('?');
+    size_t end = first_line.find(' ', 4);
+    if (qs != string::npos && qs < end) {
+        stringstream params(first_line.substr(qs + 1, end - qs - 1));
+        string kv;
+        while (getline(params, kv, '&')) {
+            size_t eq = kv.find('=');
+            if (eq != string::npos) q[url_decode(kv.substr(0, eq))] = url_decode(kv.substr(eq + 1));
+        }
+    }
+    string path = q.count("path") ? q["path"] : "/";
+    if (path.empty() || path[0] != '/') {
+        string bad = "HTTP/1.1 400 Bad Request\r\nContent-Length:0\r\n\r\n";
+        send_all(client_fd, bad);
+        close(client_fd);
+        return;
+    }
+    bool recursive = !q.count("recursive") || q["recursive"] != "false";
+    bool stats = q.count("stats") && q["stats"] == "true";
+
+    uint32_t id = watch_add(client_fd, path, recursive, stats, [client_fd](const string &event, const string &json) {
+        if (event == "ping") return send_all(client_fd, ": ping\n\n");
+        return send_all(client_fd, "event: " + event + "\ndata: " + json + "\n\n");
+    });
+    ostringstream head;
+    head << "HTTP/1.1 200 OK\r\n";
+    head << "Content-Type: text/event-stream\r\n";
+    head << "Cache-Control: no-cache\r\n";
+    head << "Access-Control-Allow-Origin: *\r\n";
+    head << "\r\n";
+    head << "event: watch\ndata: {\"watch_id\":" << id << ",\"path\":\"" << path << "\"}\n\n";
+    send_all(client_fd, head.str());
+    // a failed send above is noticed by the sender on its first push or keepalive
+    thread t([client_fd, id]() {
+        watch_run(id);
+        close(client_fd);
+    });
+    t.detach();
 }
 
 void http_server_thread() {
@@ -144,17 +666,50 @@ void http_server_thread() {
         }
 
         char buffer[8192];
-        ssize_t n = recv(client_fd, buffer, sizeof(buffer)-1, 0);
-        if (n <= 0) {
+        string req;
+        size_t header_end = string::npos;
+        size_t body_len = 0;
+        bool too_large = false;
+        while (true) {
+            ssize_t n = recv(client_fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            req.append(buffer, n);
+            if (header_end == string::npos) {
+                header_end = req.find("\r\n\r\n");
+                if (header_end == string::npos) {
+                    if (req.size() > sizeof(buffer)) break;
+                    continue;
+                }
+                size_t cl = req.find("Content-Length:");
+                if (cl == string::npos) cl = req.find("content-length:");
+                if (cl != string::npos && cl < header_end) {
+                    body_len = (size_t)strtoull(req.c_str() + cl + 15, NULL, 10);
+                }
+                if (body_len > MAX_HTTP_BODY) {
+                    too_large = true;
+                    break;
+                }
+            }
+            if (req.size() >= header_end + 4 + body_len) break;
+        }
+        if (req.empty()) {
+            close(client_fd);
+            continue;
+        }
+        if (too_large) {
+            string tooLarge = "HTTP/1.1 413 Payload Too Large\r\nContent-Length:0\r\n\r\n";
+            send(client_fd, tooLarge.c_str(), tooLarge.size(), 0);
             close(client_fd);
             continue;
         }
-        buffer[n] = 0;
-        string req(buffer);
 
         size_t firstLineEnd = req.find("\r\n");
         string firstLine = (firstLineEnd != string::npos) ? req.substr(0, firstLineEnd) : "";
         bool isPost = (firstLine.find("POST ") == 0);
+        if (firstLine.compare(0, 11, "GET /watch?") == 0 || firstLine.compare(0, 11, "GET /watch ") == 0) {
+            start_sse_watch(client_fd, firstLine);
+            continue;
+        }
         size_t pos = req.find("\r\n\r\n");
         string body = "";
         if (pos != string::npos) {
@@ -172,8 +727,6 @@ void http_server_thread() {
         string resp_json;
         try {
             resp_json = process_command(json_body);
-            Request r; r.client_fd = client_fd; r.json = json_body;
-            gqueue->enqueue(r);
         } catch (...) {
             resp_json = "{\"status\":\"error\",\"error_message\":\"internal\"}";
         }
@@ -197,56 +750,45 @@ void http_server_thread() {
     close(server_fd);
 }
 
+// the 9001 bridge goes through the same queue as 8080, so it gets the same deadlines,
+// priority classes and admission check; the HTTP thread waits here for the answer
 string process_command(const string &raw_json) {
     map<string,string> obj = parse_json_simple(raw_json);
     string cmd = obj.count("cmd") ? obj["cmd"] : "";
     string rid = obj.count("request_id") ? obj["request_id"] : "0";
-    string response;
-
-    if (cmd == "login" || cmd == "user_login") {
-        string u = obj.count("username") ? obj["username"] : "";
-        string p = obj.count("password") ? obj["password"] : "";
-        int ok = verify_user(u.c_str(), p.c_str());
-        if (ok == 0) {
-            response = string("{\"status\":\"success\",\"operation\":\"login\",\"request_id\":\"") + rid + "\",\"data\":{\"message\":\"logged_in\",\"session_id\":\"sess_" + u + "\"}}";
-        } else {
-            response = string("{\"status\":\"error\",\"operation\":\"login\",\"request_id\":\"") + rid + "\",\"error_code\":-2,\"error_message\":\"Invalid credentials\"}";
-        }
-    } else if (cmd == "stats") {
-        FSStats st;
-        if (get_stats(&st) == 0) {
-            ostringstream ss;
-            ss << "{\"status\":\"success\",\"operation\":\"stats\",\"request_id\":\"" << rid << "\",\"data\":{\"total_size\":" << st.total_size << ",\"used_space\":" << st.used_space << ",\"free_space\":" << st.free_space << "}}";
-            response = ss.str();
-        } else {
-            response = string("{\"status\":\"error\",\"operation\":\"stats\",\"request_id\":\"") + rid + "\",\"error_message\":\"cannot get stats\"}";
-        }
-    } else if (cmd == "whoami") {
-        string sid = obj.count("session_id") ? obj["session_id"] : "";
-        if (sid == "") {
-            response = string("{\"status\":\"error\",\"operation\":\"whoami\",\"request_id\":\"") + rid + "\",\"error_code\":-9,\"error_message\":\"no session\"}";
-        } else {
-            response = string("{\"status\":\"success\",\"operation\":\"whoami\",\"request_id\":\"") + rid + ("\",\"data\":{\"session_id\":\"") + sid + "\"}}";
-        }
-    } else if (cmd == "dir_list") {
-        string path = obj.count("path") ? obj["path"] : "/";
-        response = string("{\"status\":\"success\",\"operation\":\"dir_list\",\"request_id\":\"") + rid + "\",\"data\":{\"path\":\"" + path + "\",\"entries\":[]}}";
-    } else {
-        response = string("{\"status\":\"error\",\"operation\":\"unknown\",\"request_id\":\"") + rid + "\",\"error_message\":\"unknown command\"}";
+    Request req;
+    req.client_fd = -1;
+    req.json = raw_json;
+    req.req_class = request_class(cmd);
+    req.deadline_ms = queue_now_ms() + request_timeout(obj);
+    req.reply = make_shared<BridgeReply>();
+    if (!gqueue->try_enqueue(req)) {
+        g_shed_admission++;
+        return error_response(cmd, rid, static_cast<int>(OFSErrorCodes::ERROR_SERVER_BUSY), "server busy");
     }
-    return response;
+    unique_lock<mutex> lock(req.reply->m);
+    while (!req.reply->done) req.reply->cv.wait(lock);
+    return req.reply->json;
 }
 
-void start_server(const char* omni_path, int port) {
+void start_server(const char* omni_path, int port, int queue_timeout) {
     fs_init(omni_path);
 
+    g_queue_timeout_ms = (uint64_t)queue_timeout * 1000;
     gqueue = new TSQueue(1000);
+    // start shedding bulk work once requests typically wait half their timeout
+    gqueue->set_wait_budget(g_queue_timeout_ms / 2);
     thread worker(worker_thread_func);
     worker.detach();
 
     thread http(http_server_thread);
     http.detach();
 
+    watch_start();
+
+    defrag_start(DEFRAG_RATE);
+    scrub_start(SCRUB_RATE);
+
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1) {
         cout << "socket() failed\n";
@@ -0,0 +1,275 @@
+#include "../../include/watch.hpp"
+#include "../../include/ofs_core.hpp"
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <sstream>
+
+using namespace std;
+
+static const size_t WATCH_BUFFER = 256;        // queued changes per subscriber before it is resynced
+static const int COALESCE_MS = 100;            // changes gather this long before a push
+static const int STATS_INTERVAL_MS = 1000;
+static const int HEARTBEAT_MS = 15000;
+
+struct WatchChange {
+    string kind;
+    string path;
+    string from;
+};
+
+struct Subscriber {
+    uint32_t id;
+    int owner;
+    string path;
+    bool recursive;
+    bool stats;
+    WatchDeliver deliver;
+    vector<WatchChange> pending;
+    map<string,string> pending_stats;
+    bool resync;       // the buffer overflowed; the client must re-read its view
+    bool closed;
+    bool running;
+    condition_variable cv;
+};
+
+static mutex g_watch_mutex;
+static map<uint32_t, shared_ptr<Subscriber> > g_subs;
+static uint32_t g_next_watch = 1;
+static map<string,string> g_last_stats;
+static uint64_t g_resyncs = 0;
+
+static bool in_scope(const Subscriber &s, const string &p) {
+    if (p.empty()) return false;
+    if (p == s.path) return true;
+    string prefix = s.path == "/" ? "/" : s.path + "/";
+    if (p.compare(0, prefix.size(), prefix) != 0) return false;
+    return s.recursive || p.find('/', prefix.size()) == string::npos;
+}
+
+// a directory rename moves everything below it, so it also reaches subscribers
+// watching a path inside the old or the new directory
+static bool moves_watched(const Subscriber &s, const WatchChange &c) {
+    if (c.kind != "rename") return false;
+    if (s.path.compare(0, c.from.size() + 1, c.from + "/") == 0) return true;
+    return s.path.compare(0, c.path.size() + 1, c.path + "/") == 0;
+}
+
+// merges c into the queue: an edit after a create or edit of the same path adds nothing,
+// and a delete cancels a create that was never pushed
+static void add_change(Subscriber &s, const WatchChange &c) {
+    if (s.resync) return;
+    for (size_t i = s.pending.size(); i-- > 0; ) {
+        const WatchChange &prev = s.pending[i];
+        if (prev.path != c.path && prev.from != c.path) continue;
+        if (prev.path == c.path && c.kind == "edit" && (prev.kind == "edit" || prev.kind == "create")) return;
+        if (prev.path == c.path && c.kind == "delete" && prev.kind == "create") {
+            s.pending.erase(s.pending.begin() + i);
+            return;
+        }
+        break;
+    }
+    if (s.pending.size() >= WATCH_BUFFER) {
+        s.pending.clear();
+        s.pending_stats.clear();
+        s.resync = true;
+        g_resyncs++;
+        return;
+    }
+    s.pending.push_back(c);
+}
+
+static void on_change(const char* kind, const char* path, const char* from) {
+    WatchChange c;
+    c.kind = kind;
+    c.path = path;
+    c.from = from;
+    lock_guard<mutex> lock(g_watch_mutex);
+    for (map<uint32_t, shared_ptr<Subscriber> >::iterator it = g_subs.begin(); it != g_subs.end(); ++it) {
+        Subscriber &s = *it->second;
+        if (s.closed || !(in_scope(s, c.path) || in_scope(s, c.from) || moves_watched(s, c))) continue;
+        add_change(s, c);
+        s.cv.notify_all();
+    }
+}
+
+static void stats_fields(map<string,string> &out) {
+    FSStats st;
+    if (get_stats(&st) != 0) return;
+    ostringstream frag;
+    frag << st.fragmentation;
+    out["total_size"] = to_string(st.total_size);
+    out["used_space"] = to_string(st.used_space);
+    out["free_space"] = to_string(st.free_space);
+    out["total_files"] = to_string(st.total_files);
+    out["total_directories"] = to_string(st.total_directories);
+    out["logical_bytes"] = to_string(st.logical_bytes);
+    out["physical_bytes"] = to_string(st.physical_bytes);
+    out["fragmentation"] = frag.str();
+}
+
+// one snapshot per tick for all subscribers; each gets only the fields that changed
+static void stats_thread_func() {
+    while (true) {
+        this_thread::sleep_for(chrono::milliseconds(STATS_INTERVAL_MS));
+        bool wanted = false;
+        {
+            lock_guard<mutex> lock(g_watch_mutex);
+            for (map<uint32_t, shared_ptr<Subscriber> >::iterator it = g_subs.begin(); it != g_subs.end(); ++it) {
+                if (it->second->stats) wanted = true;
+            }
+        }
+        if (!wanted) continue;
+
+        map<string,string> now;
+        stats_fields(now);
+        lock_guard<mutex> lock(g_watch_mutex);
+        map<string,string> delta;
+        for (map<string,string>::iterator f = now.begin(); f != now.end(); ++f) {
+            map<string,string>::iterator old = g_last_stats.find(f->first);
+            if (old == g_last_stats.end() || old->second != f->second) delta[f->first] = f->second;
+        }
+        g_last_stats = now;
+        if (delta.empty()) continue;
+        for (map<uint32_t, shared_ptr<Subscriber> >::iterator it = g_subs.begin(); it != g_subs.end(); ++it) {
+            Subscriber &s = *it->second;
+            if (!s.stats || s.closed || s.resync) continue;
+            for (map<string,string>::iterator f = delta.begin(); f != delta.end(); ++f) s.pending_stats[f->first] = f->second;
+            s.cv.notify_all();
+        }
+    }
+}
+
+void watch_start() {
+    fs_set_change_hook(on_change);
+    thread t(stats_thread_func);
+    t.detach();
+}
+
+uint32_t watch_add(int owner, const string &path, bool recursive, bool stats, WatchDeliver deliver) {
+    shared_ptr<Subscriber> s(new Subscriber());
+    s->owner = owner;
+    s->path = path;
+    s->recursive = recursive;
+    s->stats = stats;
+    s->deliver = deliver;
+    s->resync = false;
+    s->closed = false;
+    s->running = true;
+    // a new subscriber starts from a full snapshot, later pushes are deltas
+    if (stats) stats_fields(s->pending_stats);
+    lock_guard<mutex> lock(g_watch_mutex);
+    bool others = false;
+    for (map<uint32_t, shared_ptr<Subscriber> >::iterator it = g_subs.begin(); it != g_subs.end(); ++it) {
+        if (it->second->stats) others = true;
+    }
+    // with no other stats subscriber the ticker's last snapshot is stale, so deltas start from this one
+    if (stats && !others) g_last_stats = s->pending_stats;
+    s->id = g_next_watch++;
+    g_subs[s->id] = s;
+    return s->id;
+}
+
+static string changes_json(uint32_t id, const vector<WatchChange> &changes) {
+    ostringstream ss;
+    ss << "{\"event\":\"changes\",\"watch_id\":" << id << ",\"changes\":[";
+    for (size_t i = 0; i < changes.size(); ++i) {
+        ss << (i ? "," : "") << "{\"kind\":\"" << changes[i].kind << "\",\"path\":\"" << changes[i].path << "\"";
+        if (!changes[i].from.empty()) ss << ",\"from\":\"" << changes[i].from << "\"";
+        ss << "}";
+    }
+    ss << "]}";
+    return ss.str();
+}
+
+static string stats_json(uint32_t id, const map<string,string> &fields) {
+    ostringstream ss;
+    ss << "{\"event\":\"stats\",\"watch_id\":" << id << ",\"data\":{";
+    for (map<string,string>::const_iterator f = fields.begin(); f != fields.end(); ++f) {
+        ss << (f == fields.begin() ? "" : ",") << "\"" << f->first << "\":" << f->second;
+    }
+    ss << "}}";
+    return ss.str();
+}
+
+void watch_run(uint32_t id) {
+    unique_lock<mutex> lock(g_watch_mutex);
+    map<uint32_t, shared_ptr<Subscriber> >::iterator found = g_subs.find(id);
+    if (found == g_subs.end()) return;
+    shared_ptr<Subscriber> s = found->second;
+
+    while (!s->closed) {
+        if (s->pending.empty() && s->pending_stats.empty() && !s->resync) {
+            Subscriber* sp = s.get();
+            bool woken = s->cv.wait_for(lock, chrono::milliseconds(HEARTBEAT_MS), [sp] {
+                return sp->closed || !sp->pending.empty() || !sp->pending_stats.empty() || sp->resync;
+            });
+            if (woken) continue;
+            lock.unlock();
+            bool alive = s->deliver("ping", "");
+            lock.lock();
+            if (!alive) s->closed = true;
+            continue;
+        }
+
+        // let a burst of changes collect so it goes out as one message
+        lock.unlock();
+        this_thread::sleep_for(chrono::milliseconds(COALESCE_MS));
+        lock.lock();
+        if (s->closed) break;
+        vector<WatchChange> changes;
+        map<string,string> stats;
+        changes.swap(s->pending);
+        stats.swap(s->pending_stats);
+        bool resync = s->resync;
+        s->resync = false;
+        lock.unlock();
+
+        bool ok = true;
+        if (resync) {
+            ok = s->deliver("resync", "{\"event\":\"resync\",\"watch_id\":" + to_string(id) + "}");
+            if (s->stats) stats_fields(stats);
+        }
+        if (ok && !changes.empty()) ok = s->deliver("changes", changes_json(id, changes));
+        if (ok && !stats.empty()) ok = s->deliver("stats", stats_json(id, stats));
+        lock.lock();
+        if (!ok) s->closed = true;
+    }
+
+    s->running = false;
+    g_subs.erase(id);
+    s->cv.notify_all();
+}
+
+static void stop_locked(unique_lock<mutex> &lock, shared_ptr<Subscriber> s) {
+    s->closed = true;
+    s->cv.notify_all();
+    while (s->running) s->cv.wait(lock);
+}
+
+bool watch_remove(int owner, uint32_t id) {
+    unique_lock<mutex> lock(g_watch_mutex);
+    map<uint32_t, shared_ptr<Subscriber> >::iterator it = g_subs.find(id);
+    if (it == g_subs.end() || it->second->owner != owner) return false;
+    stop_locked(lock, it->second);
+    return true;
+}
+
+void watch_remove_owner(int owner) {
+    unique_lock<mutex> lock(g_watch_mutex);
+    vector<shared_ptr<Subscriber> > mine;
+    for (map<uint32_t, shared_ptr<Subscriber> >::iterator it = g_subs.begin(); it != g_subs.end(); ++it) {
+        if (it->second->owner == owner) mine.push_back(it->second);
+    }
+    for (size_t i = 0; i < mine.size(); ++i) stop_locked(lock, mine[i]);
+}
+
+void watch_counts(uint32_t &subscribers, uint64_t &resyncs) {
+    lock_guard<mutex> lock(g_watch_mutex);
+    subscribers = (uint32_t)g_subs.size();
+    resyncs = g_resyncs;
+}
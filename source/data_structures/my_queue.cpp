@@ -1,25 +1,48 @@
 #include "../../include/my_queue.hpp"
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
+// after this many interactive requests in a row one waiting bulk request goes next
+static const int INTERACTIVE_BURST = 8;
+static const int WAIT_SAMPLES = 256;
+
 struct TSQImpl {
-    Request* arr;
+    Request* arr[2];
     int capacity;
-    int head;
-    int tail;
-    int count;
+    int head[2];
+    int tail[2];
+    int count[2];
+    int burst;
+    uint64_t waits[WAIT_SAMPLES];
+    int wait_count;
+    int wait_pos;
+    uint64_t p99;
+    uint64_t budget;
     std::mutex m;
     std::condition_variable cv;
     TSQImpl(int cap) {
         capacity = cap;
-        arr = new Request[capacity];
-        head = 0; tail = 0; count = 0;
+        for (int c = 0; c < 2; ++c) {
+            arr[c] = new Request[capacity];
+            head[c] = 0; tail[c] = 0; count[c] = 0;
+        }
+        burst = 0;
+        wait_count = 0; wait_pos = 0;
+        p99 = 0;
+        budget = 0;
     }
-    ~TSQImpl() { delete[] arr; }
+    ~TSQImpl() { delete[] arr[0]; delete[] arr[1]; }
 };
 
+uint64_t queue_now_ms() {
+    return (uint64_t)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 TSQueue::TSQueue(int cap) {
     impl = (void*) new TSQImpl(cap);
 }
@@ -29,27 +52,66 @@ TSQueue::~TSQueue() {
     delete p;
 }
 
+static void push_locked(TSQImpl* p, const Request &r) {
+    int c = r.req_class == REQ_INTERACTIVE ? REQ_INTERACTIVE : REQ_BULK;
+    p->arr[c][p->tail[c]] = r;
+    p->arr[c][p->tail[c]].enqueue_ms = queue_now_ms();
+    p->tail[c] = (p->tail[c] + 1) % p->capacity;
+    p->count[c]++;
+    p->cv.notify_all();
+}
+
 void TSQueue::enqueue(const Request &r) {
     TSQImpl* p = (TSQImpl*)impl;
     std::unique_lock<std::mutex> lock(p->m);
-    while (p->count == p->capacity) {
+    while (p->count[0] + p->count[1] == p->capacity) {
         p->cv.wait(lock);
     }
-    p->arr[p->tail] = r;
-    p->tail = (p->tail + 1) % p->capacity;
-    p->count++;
-    p->cv.notify_all();
+    push_locked(p, r);
+}
+
+bool TSQueue::try_enqueue(const Request &r) {
+    TSQImpl* p = (TSQImpl*)impl;
+    std::unique_lock<std::mutex> lock(p->m);
+    if (r.req_class != REQ_INTERACTIVE && p->budget && p->p99 > p->budget && p->count[REQ_BULK] > 0) {
+        return false;
+    }
+    while (p->count[0] + p->count[1] == p->capacity) {
+        p->cv.wait(lock);
+    }
+    push_locked(p, r);
+    return true;
 }
 
 Request TSQueue::dequeue() {
     TSQImpl* p = (TSQImpl*)impl;
     std::unique_lock<std::mutex> lock(p->m);
-    while (p->count == 0) {
+    while (p->count[0] + p->count[1] == 0) {
         p->cv.wait(lock);
     }
-    Request tmp = p->arr[p->head];
-    p->head = (p->head + 1) % p->capacity;
-    p->count--;
+    int c = REQ_INTERACTIVE;
+    if (p->count[REQ_INTERACTIVE] == 0 || (p->count[REQ_BULK] > 0 && p->burst >= INTERACTIVE_BURST)) {
+        c = REQ_BULK;
+    }
+    p->burst = (c == REQ_INTERACTIVE) ? p->burst + 1 : 0;
+
+    Request tmp = p->arr[c][p->head[c]];
+    p->head[c] = (p->head[c] + 1) % p->capacity;
+    p->count[c]--;
+
+    // keep a rolling p99 of how long requests sat in the queue
+    uint64_t now = queue_now_ms();
+    p->waits[p->wait_pos] = now > tmp.enqueue_ms ? now - tmp.enqueue_ms : 0;
+    p->wait_pos = (p->wait_pos + 1) % WAIT_SAMPLES;
+    if (p->wait_count < WAIT_SAMPLES) p->wait_count++;
+    if (p->wait_pos % 16 == 0 || p->count[0] + p->count[1] == 0) {
+        vector<uint64_t> w(p->waits, p->waits + p->wait_count);
+        size_t k = (w.size() * 99) / 100;
+        if (k >= w.size()) k = w.size() - 1;
+        nth_element(w.begin(), w.begin() + k, w.end());
+        p->p99 = w[k];
+    }
+
     p->cv.notify_all();
     return tmp;
 }
@@ -57,5 +119,17 @@ Request TSQueue::dequeue() {
 bool TSQueue::empty() {
     TSQImpl* p = (TSQImpl*)impl;
     std::unique_lock<std::mutex> lock(p->m);
-    return p->count == 0;
+    return p->count[0] + p->count[1] == 0;
+}
+
+void TSQueue::set_wait_budget(uint64_t ms) {
+    TSQImpl* p = (TSQImpl*)impl;
+    std::unique_lock<std::mutex> lock(p->m);
+    p->budget = ms;
+}
+
+uint64_t TSQueue::wait_p99() {
+    TSQImpl* p = (TSQImpl*)impl;
+    std::unique_lock<std::mutex> lock(p->m);
+    return p->p99;
 }
\ No newline at end of file
@@ -44,11 +44,24 @@ document.querySelectorAll("#tabs button").forEach(btn => {
   });
 });
 
+// live changes and stats deltas over Server-Sent Events instead of polling
+let watchSource = null;
+function startWatch() {
+  if (watchSource) watchSource.close();
+  watchSource = new EventSource(serverUrl().replace(/\/$/, "") + "/watch?path=%2F&stats=true");
+  ["changes", "stats", "resync"].forEach(name => {
+    watchSource.addEventListener(name, e => logResponse("[" + name + "] " + e.data));
+  });
+}
+
 // connect button
 document.getElementById("connectBtn").addEventListener("click", async () => {
   logResponse("[info] Using " + serverUrl());
   const r = await sendJson({ cmd: "stats", request_id: makeRequestId("ping") });
-  if (r) logResponse("[info] ping OK");
+  if (r) {
+    logResponse("[info] ping OK");
+    startWatch();
+  }
 });
 
 // login